@@ -0,0 +1,4 @@
+TEMPLATE = subdirs
+CONFIG   = ordered
+
+SUBDIRS += qicbench
@@ -0,0 +1,761 @@
+/* Copyright (c) 2018 Martin Kutny
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <QThread>
+#include <QTimer>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include <qicruntime.h>
+#include <qiccontext.h>
+
+//
+// Benchmarks of the qicRuntime build and execution pipeline. Run without
+// arguments to run all benchmarks, or pass the names of the benchmarks to run.
+// Pass --json <file> to also write the results as JSON. The benchmarks need
+// no display and run headless.
+//
+
+static QTextStream out(stdout);
+static QJsonArray results;
+
+// Prints a result line and records the values for the JSON output.
+static void report(const QString &name, const QString &text, const QJsonObject &values)
+{
+    out << name << ": " << text << Qt::endl;
+    QJsonObject result = values;
+    result.insert("name", name);
+    results.append(result);
+}
+
+static void configure(qicRuntime &rt)
+{
+    rt.setIncludePath({ QIC_SOURCE_DIR });
+#ifdef QT_DEBUG
+    // Same as in the examples, the runtime-compiled code must link with the
+    // same Qt and CRT libraries as the host.
+    rt.setQtConfig({ "debug" });
+#endif
+}
+
+static QString trivialSource(int n)
+{
+    // The counter makes every source unique, so that each build goes through
+    // the whole toolchain.
+    return QString("#include <qicentry.h>\n"
+                   "extern \"C\" QIC_ENTRY_EXPORT void qic_entry(qicContext *) {}\n"
+                   "// %1\n").arg(n);
+}
+
+static QString qtSource(int n)
+{
+    return QString("#include <qicentry.h>\n"
+                   "#include <QtCore>\n"
+                   "extern \"C\" QIC_ENTRY_EXPORT void qic_entry(qicContext *) {\n"
+                   "    QMap<QString, QVariant> map;\n"
+                   "    map.insert(QStringLiteral(\"n\"), %1);\n"
+                   "    QJsonDocument doc(QJsonObject::fromVariantMap(map));\n"
+                   "    (void) doc.toJson();\n"
+                   "}\n").arg(n);
+}
+
+static QString largeSource(int n)
+{
+    // Many small functions and template instantiations, roughly the size of
+    // a large hand-written script.
+    QString src = "#include <qicentry.h>\n"
+                  "#include <vector>\n"
+                  "#include <algorithm>\n"
+                  "template<int N> struct Acc { static int sum(const std::vector<int> &v) {\n"
+                  "    int s = N; for (int x : v) s += x * N; return s; } };\n";
+    for (int i = 0; i < 300; ++i) {
+        src += QString("int f%1(int x) { std::vector<int> v(x, %1); std::sort(v.begin(), v.end());"
+                       " return Acc<%1>::sum(v); }\n").arg(i);
+    }
+    src += "extern \"C\" QIC_ENTRY_EXPORT void qic_entry(qicContext *) {\n    volatile int s = 0;\n";
+    for (int i = 0; i < 300; ++i) {
+        src += QString("    s = s + f%1(3);\n").arg(i);
+    }
+    src += QString("}\n// %1\n").arg(n);
+    return src;
+}
+
+static double median(std::vector<double> v)
+{
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+static double minimum(const std::vector<double> &v)
+{
+    return v.empty() ? 0 : *std::min_element(v.begin(), v.end());
+}
+
+//
+// Compares the qmake build with the direct compiler invocation.
+//
+static void benchBuildModes(int iterations)
+{
+    const struct {
+        const char *name;
+        qicRuntime::BuildMode mode;
+    } modes[] = {
+        { "qmake",  qicRuntime::QmakeBuild },
+        { "direct", qicRuntime::DirectBuild },
+    };
+
+    for (const auto &m : modes) {
+        qicRuntime rt;
+        configure(rt);
+        rt.setBuildCache(false);
+        rt.setBuildMode(m.mode);
+
+        // The first build of the direct mode includes probing of the
+        // compiler flags, so it is reported separately.
+        double first = 0;
+        std::vector<double> times;
+        QElapsedTimer timer;
+        for (int i = 0; i <= iterations; ++i) {
+            timer.start();
+            if (!rt.exec(trivialSource(i))) {
+                out << "build-modes/" << m.name << ": build failed" << Qt::endl;
+                return;
+            }
+            double ms = timer.nsecsElapsed() / 1e6;
+            if (i == 0) {
+                first = ms;
+            } else {
+                times.push_back(ms);
+            }
+        }
+
+        report(QString("build-modes/%1").arg(m.name),
+               QString("first %1 ms, median %2 ms, min %3 ms")
+                   .arg(first, 0, 'f', 1)
+                   .arg(median(times), 0, 'f', 1)
+                   .arg(minimum(times), 0, 'f', 1),
+               {{ "first_ms", first }, { "median_ms", median(times) }, { "min_ms", minimum(times) }});
+    }
+}
+
+//
+// Measures exec() latency of trivial, Qt-heavy and large sources. Cold
+// execs build unique sources with the build cache disabled, warm execs
+// repeat one source, so that they are served from the build cache and only
+// load and execute the library.
+//
+static void benchExec(int iterations)
+{
+    const struct {
+        const char *name;
+        QString (*source)(int);
+        bool qt;
+    } kinds[] = {
+        { "trivial", trivialSource, false },
+        { "qt",      qtSource,      true },
+        { "large",   largeSource,   false },
+    };
+
+    for (const auto &k : kinds) {
+        for (bool warm : { false, true }) {
+            qicRuntime rt;
+            configure(rt);
+            rt.setBuildMode(qicRuntime::DirectBuild);
+            rt.setBuildCache(warm);
+            if (k.qt) {
+                rt.setQtLibs({ "core" });
+            }
+
+            // the first exec probes the compiler flags, or fills the cache
+            if (!rt.exec(k.source(0))) {
+                out << "exec/" << k.name << ": build failed" << Qt::endl;
+                return;
+            }
+
+            std::vector<double> total, compile, load, entry;
+            for (int i = 1; i <= iterations; ++i) {
+                if (!rt.exec(k.source(warm ? 0 : i))) {
+                    out << "exec/" << k.name << ": build failed" << Qt::endl;
+                    return;
+                }
+                const qicExecStats stats = rt.lastExecStats();
+                total.push_back(stats.total / 1e3);
+                compile.push_back(stats.compile / 1e3);
+                load.push_back(stats.load / 1e3);
+                entry.push_back(stats.entry / 1e3);
+            }
+
+            report(QString("exec/%1/%2").arg(k.name, warm ? "warm" : "cold"),
+                   QString("median %1 ms (compile %2 ms, load %3 ms, entry %4 ms), min %5 ms")
+                       .arg(median(total), 0, 'f', 2)
+                       .arg(median(compile), 0, 'f', 2)
+                       .arg(median(load), 0, 'f', 2)
+                       .arg(median(entry), 0, 'f', 2)
+                       .arg(minimum(total), 0, 'f', 2),
+                   {{ "median_ms", median(total) }, { "min_ms", minimum(total) },
+                    { "compile_ms", median(compile) }, { "load_ms", median(load) },
+                    { "entry_ms", median(entry) }});
+        }
+    }
+}
+
+//
+// Measures qicContext::get() and set() as the number of frames and variables
+// grows. Every frame is created by executing a script that registers a
+// number of variables. The same script is executed repeatedly, so all but
+// the first build are served from the build cache.
+//
+static void benchContext(int varsPerFrame)
+{
+    const QString source = QString(
+        "#include <qicentry.h>\n"
+        "#include <qiccontext.h>\n"
+        "#include <stdio.h>\n"
+        "static int value;\n"
+        "extern \"C\" QIC_ENTRY_EXPORT void qic_entry(qicContext *ctx) {\n"
+        "    char name[32];\n"
+        "    for (int i = 0; i < %1; ++i) {\n"
+        "        snprintf(name, sizeof(name), \"var%d\", i);\n"
+        "        ctx->set(&value, name);\n"
+        "    }\n"
+        "}\n").arg(varsPerFrame);
+
+    qicRuntime rt;
+    configure(rt);
+    rt.setBuildMode(qicRuntime::DirectBuild);
+
+    // The host variable lives in the oldest frame, the worst case for a
+    // search through the frames.
+    int host = 0;
+    rt.ctx()->set(&host, "host");
+
+    const int lookups = 1000000;
+    const int sets = 10000;
+    int frames = 0;
+    for (int target : { 1, 10, 100, 1000, 2000 }) {
+        for (; frames < target; ++frames) {
+            if (!rt.exec(source)) {
+                out << "context: build failed" << Qt::endl;
+                return;
+            }
+        }
+
+        qicContext *ctx = rt.ctx();
+        void *sink = nullptr;
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < lookups; ++i) {
+            sink = ctx->get((i & 1) ? "host" : "var0");
+        }
+        double ns = double(timer.nsecsElapsed()) / lookups;
+
+        qicHandle handle = ctx->resolve("host");
+        timer.start();
+        for (int i = 0; i < lookups; ++i) {
+            sink = ctx->load(handle);
+        }
+        double ns_handle = double(timer.nsecsElapsed()) / lookups;
+
+        // the variables are added to the newest frame and stay there
+        static int value;
+        timer.start();
+        for (int i = 0; i < sets; ++i) {
+            ctx->set(&value, (i & 1) ? "var0" : "var1");
+        }
+        double ns_set = double(timer.nsecsElapsed()) / sets;
+
+        report("context/get",
+               QString("%1 frames, %2 variables: %3 ns per lookup, %4 ns per handle load, %5 ns per set%6")
+                   .arg(frames)
+                   .arg(frames * varsPerFrame + 1)
+                   .arg(ns, 0, 'f', 1)
+                   .arg(ns_handle, 0, 'f', 1)
+                   .arg(ns_set, 0, 'f', 1)
+                   .arg(sink ? "" : " (lookup failed)"),
+               {{ "frames", frames }, { "variables", frames * varsPerFrame + 1 },
+                { "get_ns", ns }, { "load_ns", ns_handle }, { "set_ns", ns_set }});
+    }
+}
+
+//
+// Measures the cost of loading and unloading a library as the number of
+// loaded libraries grows. The libraries are served from the build cache.
+//
+static void benchFrames(int samples)
+{
+    qicRuntime rt;
+    configure(rt);
+    rt.setBuildMode(qicRuntime::DirectBuild);
+
+    int frames = 0;
+    for (int target : { 1, 10, 100, 500 }) {
+        for (; frames < target; ++frames) {
+            if (!rt.exec(trivialSource(0))) {
+                out << "frames: build failed" << Qt::endl;
+                return;
+            }
+        }
+
+        std::vector<double> load, unload;
+        QElapsedTimer timer;
+        for (int i = 0; i < samples; ++i) {
+            if (!rt.exec(trivialSource(0))) {
+                out << "frames: build failed" << Qt::endl;
+                return;
+            }
+            load.push_back(rt.lastExecStats().load / 1e3);
+            timer.start();
+            rt.popFrame();
+            unload.push_back(timer.nsecsElapsed() / 1e6);
+        }
+
+        report("frames/load",
+               QString("%1 frames: load %2 ms, unload %3 ms")
+                   .arg(frames)
+                   .arg(median(load), 0, 'f', 3)
+                   .arg(median(unload), 0, 'f', 3),
+               {{ "frames", frames }, { "load_ms", median(load) }, { "unload_ms", median(unload) }});
+    }
+}
+
+//
+// Measures the latency from saving a watched file to the return of its
+// qic_entry(). The debounce delay of the watcher is reported separately.
+//
+static void benchWatch(int iterations)
+{
+    QTemporaryDir dir;
+    const QString path = dir.filePath("watched.cpp");
+    auto save = [&path](int n) {
+        QFile f(path);
+        if (f.open(QIODevice::WriteOnly)) {
+            f.write(trivialSource(n).toUtf8());
+        }
+    };
+    save(0);
+
+    qicRuntime rt;
+    configure(rt);
+    rt.setBuildMode(qicRuntime::DirectBuild);
+    rt.setBuildCache(false);
+    const int delay = 20;
+    rt.setWatchDelay(delay);
+    if (!rt.watchExecFile(path, true)) {
+        out << "watch: build failed" << Qt::endl;
+        return;
+    }
+
+    std::vector<double> times;
+    QElapsedTimer timer;
+    for (int i = 1; i <= iterations; ++i) {
+        QEventLoop loop;
+        bool ok = false;
+        QObject::connect(&rt, &qicRuntime::execFinished, &loop, [&loop, &ok](int, bool success) {
+            ok = success;
+            loop.quit();
+        });
+        QTimer::singleShot(60000, &loop, &QEventLoop::quit);
+        timer.start();
+        save(i);
+        loop.exec();
+        if (!ok) {
+            out << "watch: build failed or timed out" << Qt::endl;
+            return;
+        }
+        times.push_back(timer.nsecsElapsed() / 1e6);
+    }
+
+    report("watch/reload",
+           QString("median %1 ms, min %2 ms, including %3 ms debounce delay")
+               .arg(median(times), 0, 'f', 1)
+               .arg(minimum(times), 0, 'f', 1)
+               .arg(delay),
+           {{ "median_ms", median(times) }, { "min_ms", minimum(times) }, { "delay_ms", delay }});
+}
+
+//
+// Measures the latency of REPL cells as the session grows. Each cell defines
+// a function that calls the one of the previous cell, so every cell depends
+// on the declarations of the earlier cells.
+//
+static void benchCells(int samples)
+{
+    qicRuntime rt;
+    configure(rt);
+    rt.setBuildMode(qicRuntime::DirectBuild);
+
+    if (!rt.execCell("int f0(int x) { return x; }")) {
+        out << "cells: build failed" << Qt::endl;
+        return;
+    }
+    int cells = 1;
+    for (int target : { 1, 10, 50 }) {
+        std::vector<double> times;
+        for (; cells < target + samples; ++cells) {
+            const QString decl = QString("int f%1(int x) { return f%2(x) + 1; }").arg(cells).arg(cells - 1);
+            const QString stmt = QString("f%1(0);").arg(cells);
+            if (!rt.execCell(decl, stmt)) {
+                out << "cells: build failed" << Qt::endl;
+                return;
+            }
+            if (cells >= target) {
+                times.push_back(rt.lastExecStats().total / 1e3);
+            }
+        }
+
+        report("cells/exec",
+               QString("%1 cells: median %2 ms")
+                   .arg(target)
+                   .arg(median(times), 0, 'f', 1),
+               {{ "cells", target }, { "median_ms", median(times) }});
+    }
+}
+
+//
+// Stress test and throughput of concurrent context reads. Reader threads
+// look variables up by name and through handles, while the main thread keeps
+// registering new variables, which grows the name index, and loading and
+// unloading libraries. Reports the lookups per second for each number of
+// reader threads and fails if a reader sees a wrong value.
+//
+static bool benchThreads(int msecPerRun)
+{
+    const QString source =
+        "#include <qicentry.h>\n"
+        "#include <qiccontext.h>\n"
+        "#include <stdio.h>\n"
+        "static int value = 42;\n"
+        "static int runs;\n"
+        "extern \"C\" QIC_ENTRY_EXPORT void qic_entry(qicContext *ctx) {\n"
+        "    char name[32];\n"
+        "    for (int i = 0; i < 100; ++i) {\n"
+        "        snprintf(name, sizeof(name), \"var%d_%d\", runs, i);\n"
+        "        ctx->set(&value, name);\n"
+        "    }\n"
+        "    ctx->set(&value, \"shared\");\n"
+        "    ++runs;\n"
+        "}\n";
+
+    qicRuntime rt;
+    configure(rt);
+    rt.setBuildMode(qicRuntime::DirectBuild);
+    rt.setMaxFrames(8);
+
+    static int host = 7;
+    rt.ctx()->set(&host, "host");
+
+    const qicScript script = rt.compileOnly(source);
+    if (!script) {
+        out << "threads: build failed" << Qt::endl;
+        return false;
+    }
+
+    bool ok = true;
+    const int cores = QThread::idealThreadCount();
+    for (int count = 1; ; count *= 2) {
+        count = qMin(count, cores);
+
+        std::atomic<bool> stop { false };
+        std::atomic<qint64> lookups { 0 };
+        std::atomic<int> errors { 0 };
+        std::vector<std::thread> readers;
+        for (int t = 0; t < count; ++t) {
+            readers.emplace_back([&rt, &stop, &lookups, &errors]() {
+                qicContext *ctx = rt.ctx();
+                const qicHandle shared = ctx->resolve("shared");
+                qint64 n = 0;
+                int bad = 0;
+                char name[32];
+                while (!stop.load(std::memory_order_relaxed)) {
+                    // the host variable is never replaced
+                    const int *v = static_cast<int *>(ctx->get("host"));
+                    if (!v || *v != 7) ++bad;
+                    // the script variables come and go, only check that the
+                    // lookups return
+                    snprintf(name, sizeof(name), "var%d_%d", int(n % 50), int(n % 100));
+                    (void) ctx->get(name);
+                    (void) ctx->load(shared);
+                    n += 3;
+                }
+                lookups += n;
+                errors += bad;
+            });
+        }
+
+        // keep writing until the time is up
+        QElapsedTimer timer;
+        timer.start();
+        int writes = 0;
+        while (!timer.hasExpired(msecPerRun)) {
+            rt.run(script);
+            if (++writes % 20 == 0 && !rt.exec(source)) {
+                ok = false;
+                break;
+            }
+        }
+        const double seconds = timer.nsecsElapsed() / 1e9;
+        stop = true;
+        for (std::thread &reader : readers) {
+            reader.join();
+        }
+
+        const double rate = lookups / seconds;
+        report("threads/get",
+               QString("%1 readers: %2 M lookups/s, %3 M per reader, %4 writes, %5 errors")
+                   .arg(count)
+                   .arg(rate / 1e6, 0, 'f', 1)
+                   .arg(rate / count / 1e6, 0, 'f', 1)
+                   .arg(writes)
+                   .arg(errors.load()),
+               {{ "readers", count }, { "lookups_per_s", rate }, { "writes", writes },
+                { "errors", errors.load() }});
+        if (errors != 0) {
+            ok = false;
+        }
+        if (!ok || count == cores) {
+            break;
+        }
+    }
+
+    rt.release(script);
+    return ok;
+}
+
+// Types shared by the host and the scripts of benchStress(). The type
+// identifiers are the same on both sides, since both define the types alike.
+struct StressA
+{
+    int magic;
+};
+
+struct StressB
+{
+    double pad;
+    int magic;
+};
+
+static int stressWork(int x)
+{
+    return x * 7 + 1;
+}
+
+static QtMessageHandler defaultHandler;
+
+// Drops the type mismatch warnings, which the readers of benchStress() get
+// by design, and passes all other messages on.
+static void stressMessageHandler(QtMsgType type, const QMessageLogContext &context, const QString &msg)
+{
+    if (type == QtWarningMsg && msg.contains("registered with a different type")) {
+        return;
+    }
+    defaultHandler(type, context, msg);
+}
+
+//
+// Stress test of values and functions that are replaced while other threads
+// use them. The main thread keeps executing scripts that set a variable to
+// objects of two different types and export a new implementation of a
+// function, with a frame limit and popFrame() unloading their libraries.
+// Reader threads fetch the variable with both types and call the function.
+// Fails if a reader gets an object of the wrong type or a wrong result.
+//
+static bool benchStress(int msec)
+{
+    auto source = [](int n) {
+        const bool a = n % 2 == 0;
+        return QString(
+            "#include <qicentry.h>\n"
+            "#include <qiccontext.h>\n"
+            "struct StressA { int magic; };\n"
+            "struct StressB { double pad; int magic; };\n"
+            "static int work(int x) {\n"
+            "    for (volatile int i = 0; i < 100; i = i + 1) {}\n"
+            "    return x * 7 + 1;\n"
+            "}\n"
+            "extern \"C\" QIC_ENTRY_EXPORT void qic_exports(qicContext *ctx) {\n"
+            "    ctx->exportFunction<int(int)>(\"work\", &work);\n"
+            "}\n"
+            "extern \"C\" QIC_ENTRY_EXPORT void qic_entry(qicContext *ctx) {\n"
+            "    // never deleted, readers may still hold the object\n"
+            "    ctx->setChecked(%1, \"typed\", nullptr, qicTypeOf<%2>());\n"
+            "}\n"
+            "// %3\n")
+            .arg(a ? "new StressA{ 0xA }" : "new StressB{ 0.0, 0xB }")
+            .arg(a ? "StressA" : "StressB")
+            .arg(n);
+    };
+
+    qicRuntime rt;
+    configure(rt);
+    rt.setBuildMode(qicRuntime::DirectBuild);
+    rt.setMaxFrames(4);
+
+    // the host implementation stays in the global frame, so the function is
+    // always exported
+    rt.ctx()->exportFunction<int(int)>("work", &stressWork);
+
+    const int versions = 8;
+    for (int n = 0; n < versions; ++n) {
+        if (!rt.exec(source(n))) {
+            out << "stress: build failed" << Qt::endl;
+            return false;
+        }
+    }
+
+    defaultHandler = qInstallMessageHandler(stressMessageHandler);
+
+    std::atomic<bool> stop { false };
+    std::atomic<qint64> reads { 0 };
+    std::atomic<qint64> calls { 0 };
+    std::atomic<int> errors { 0 };
+    std::vector<std::thread> readers;
+    const int count = qMax(2, QThread::idealThreadCount() - 1);
+    for (int t = 0; t < count; ++t) {
+        readers.emplace_back([&rt, &stop, &reads, &calls, &errors, t]() {
+            qicContext *ctx = rt.ctx();
+            const qicFunction<int(int)> work = ctx->function<int(int)>("work");
+            if (!work.isValid()) {
+                ++errors;
+                return;
+            }
+            qint64 r = 0, c = 0;
+            int bad = 0;
+            for (int i = t; !stop.load(std::memory_order_relaxed); ++i) {
+                const auto *a = static_cast<StressA *>(ctx->getChecked("typed", qicTypeOf<StressA>()));
+                if (a && a->magic != 0xA) ++bad;
+                const auto *b = static_cast<StressB *>(ctx->getChecked("typed", qicTypeOf<StressB>()));
+                if (b && b->magic != 0xB) ++bad;
+                r += 2;
+                if (work(i) != i * 7 + 1) ++bad;
+                ++c;
+            }
+            reads += r;
+            calls += c;
+            errors += bad;
+        });
+    }
+
+    // swap the versions until the time is up
+    QElapsedTimer timer;
+    timer.start();
+    bool ok = true;
+    int execs = 0, pops = 0;
+    while (!timer.hasExpired(msec)) {
+        if (!rt.exec(source(execs % versions))) {
+            ok = false;
+            break;
+        }
+        // a pop fails while calls still run in the frame, which is fine
+        if (++execs % 5 == 0 && rt.popFrame()) {
+            ++pops;
+        }
+    }
+    stop = true;
+    for (std::thread &reader : readers) {
+        reader.join();
+    }
+    qInstallMessageHandler(defaultHandler);
+
+    report("stress/swap",
+           QString("%1 readers: %2 execs, %3 pops, %4 reads, %5 calls, %6 errors")
+               .arg(count)
+               .arg(execs)
+               .arg(pops)
+               .arg(reads.load())
+               .arg(calls.load())
+               .arg(errors.load()),
+           {{ "readers", count }, { "execs", execs }, { "pops", pops },
+            { "reads", double(reads.load()) }, { "calls", double(calls.load()) },
+            { "errors", errors.load() }});
+    if (!ok) {
+        out << "stress: build failed" << Qt::endl;
+    }
+    return ok && errors == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QStringList names = app.arguments().mid(1);
+    QString json;
+    const int i = names.indexOf("--json");
+    if (i >= 0 && i + 1 < names.size()) {
+        json = names.at(i + 1);
+        names.erase(names.begin() + i, names.begin() + i + 2);
+    }
+    auto selected = [&names](const char *name) {
+        return names.isEmpty() || names.contains(name);
+    };
+
+    if (selected("build-modes")) {
+        benchBuildModes(10);
+    }
+    if (selected("exec")) {
+        benchExec(10);
+    }
+    if (selected("context")) {
+        benchContext(10);
+    }
+    if (selected("frames")) {
+        benchFrames(20);
+    }
+    if (selected("watch")) {
+        benchWatch(10);
+    }
+    if (selected("cells")) {
+        benchCells(5);
+    }
+    bool ok = true;
+    if (selected("threads")) {
+        ok = benchThreads(1000);
+    }
+    if (selected("stress")) {
+        ok = benchStress(2000) && ok;
+    }
+
+    if (!json.isEmpty()) {
+        QJsonObject doc;
+        doc.insert("qt", QT_VERSION_STR);
+        doc.insert("date", QDateTime::currentDateTimeUtc().toString(Qt::ISODate));
+        doc.insert("results", results);
+        QFile f(json);
+        if (!f.open(QIODevice::WriteOnly)) {
+            out << "Failed to write " << json << Qt::endl;
+            return 1;
+        }
+        f.write(QJsonDocument(doc).toJson());
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,19 @@
+TEMPLATE = app
+
+QT += core
+
+CONFIG += console
+
+SOURCES += \
+    qicbench-main.cpp
+
+# the runtime-compiled benchmark code includes the qicruntime headers
+DEFINES += QIC_SOURCE_DIR=\\\"$$PWD/../../qicruntime\\\"
+
+# library: qiccontext
+win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../../qicruntime/release/ -lqicruntime
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../../qicruntime/debug/ -lqicruntime
+else:unix: LIBS += -L$$OUT_PWD/../../qicruntime/ -lqicruntime
+
+INCLUDEPATH += $$PWD/../../qicruntime
+DEPENDPATH += $$PWD/../../qicruntime
@@ -20,6 +20,8 @@ int main(int argc, char *argv[])
                         base_dir + "src/examples/drawing" });
     // Our script will be using these Qt libraries.
     rt.setQtLibs({ "core", "gui", "widgets" });
+    // Precompile the heavy Qt headers included by the script.
+    rt.setPrecompiledHeaders({ "QLabel", "QImage", "QPainter" });
 
     //
     // We are going to watch this file and recompile and execute it whenever
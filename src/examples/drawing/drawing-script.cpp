@@ -28,6 +28,6 @@ extern "C" QIC_ENTRY_EXPORT void qic_entry(qicContext *ctx)
     //
     // Get the application widget and paint something on it.
     //
-    QLabel *const label = static_cast<QLabel*>(ctx->get("label"));
+    QLabel *const label = ctx->get<QLabel>("label");
     label->setPixmap(QPixmap::fromImage(paint()));
 }
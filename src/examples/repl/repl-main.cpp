@@ -24,20 +24,19 @@ int main()
     int x = 961;
     rt.ctx()->set(&x, "x");
 
-    QString boilerplate = "#include <qicentry.h>\n"
-                          "#include <qiccontext.h>\n"
-                          "extern \"C\" QIC_ENTRY_EXPORT void qic_entry(qicContext *ctx) {\n"
-                          "    %CODE%\n"
-                          "}\n";
     QString code;
 
     QTextStream out(stdout);
     QTextStream in(stdin);
 
-    out << "REPL: Type C++ code here, then type 'go' to compile and run, or 'quit' to exit." << Qt::endl;
+    out << "REPL: Type C++ code here, then type 'go' to compile and run it as statements,\n"
+           "'def' to compile it as declarations that later code can use, 'reset' to forget\n"
+           "all declarations, or 'quit' to exit." << Qt::endl;
 
     //
     // REPL - Well, not exactly a REPL, rather a Read-Compile-Execute-Loop.
+    // Each block of code is a cell that sees the declarations of the earlier
+    // cells and compiles only its own code.
     //
     while (true) {
         QString line = in.readLine();
@@ -45,10 +44,14 @@ int main()
             break;
         } else if (line == "clear") {
             code.clear();
+        } else if (line == "reset") {
+            rt.clearCells();
+            code.clear();
         } else if (line == "go") {
-            QString source = boilerplate;
-            source.replace("%CODE%", code);
-            rt.exec(source);
+            rt.execCell(QString(), code);
+            code.clear();
+        } else if (line == "def") {
+            rt.execCell(code);
             code.clear();
         } else {
             code += line + "\n";
@@ -0,0 +1,44 @@
+/* Copyright (c) 2018 Martin Kutny
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include <QCoreApplication>
+#include <QTextStream>
+#include <qicruntime.h>
+
+//
+// Build server for qicRuntime. Started by qicRuntime::setBuildServer(), which
+// passes the name of the local socket to listen on:
+//
+//     qicbuildd --name <socket name>
+//
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    const QStringList args = app.arguments();
+    const int i = args.indexOf("--name");
+    if (i < 0 || i + 1 >= args.size()) {
+        QTextStream(stderr) << "usage: qicbuildd --name <socket name>" << Qt::endl;
+        return 2;
+    }
+
+    return qicRuntime::runBuildServer(args.at(i + 1));
+}
@@ -21,6 +21,229 @@ SOFTWARE. */
 #ifndef QICCONTEXT_H
 #define QICCONTEXT_H
 
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+/**
+    \def QIC_CONTEXT_VERSION
+    Version of the qicContext interface declared by this header. New methods
+    are only ever appended to qicContext, so code compiled against an older
+    version of this header keeps working with a newer runtime.
+ */
+#define QIC_CONTEXT_VERSION 5
+
+/**
+    \struct qicSlot
+    Holds the current value of a context variable. Returned by
+    qicContext::resolve() as a qicHandle. The slot of a variable never
+    changes, only its value does.
+ */
+struct qicSlot
+{
+    std::atomic<void *> ptr { nullptr };
+};
+
+typedef qicSlot *qicHandle;
+
+/**
+    \struct qicFunctionImpl
+    One implementation of an exported function and the number of calls that
+    are currently executing it. The runtime keeps the library of the
+    implementation loaded until the count drops to zero.
+ */
+struct qicFunctionImpl
+{
+    void *fn = nullptr;
+    std::atomic<int> calls { 0 };
+};
+
+/**
+    \struct qicFunctionSlot
+    Holds the current implementation of an exported function. Returned by
+    qicContext::resolveFunction() and wrapped by qicFunction. The slot of a
+    function never changes, only its target does.
+ */
+struct qicFunctionSlot
+{
+    std::atomic<qicFunctionImpl *> impl { nullptr };
+};
+
+/**
+    \def QIC_TYPE_CHECKS
+    When defined, the typed accessors qicContext::get<T>() and
+    qicContext::set<T>() verify the type of context variables at runtime.
+    Defined by default in debug builds. Define QIC_NO_TYPE_CHECKS to disable
+    the checks in debug builds. Without the checks, the typed accessors cost
+    the same as the untyped ones.
+ */
+#if !defined(QIC_TYPE_CHECKS) && !defined(QIC_NO_TYPE_CHECKS) && \
+    (defined(QT_DEBUG) || (!defined(NDEBUG) && !defined(QT_NO_DEBUG)))
+#define QIC_TYPE_CHECKS
+#endif
+
+/**
+    \fn qicTypeOf()
+    Returns the type identifier of type T, a hash of the type's name computed
+    at compile time. The identifier is the same in the host program and in
+    the runtime-compiled code, as long as both are built by the same
+    compiler.
+ */
+typedef unsigned long long qicTypeId;
+
+namespace qic_detail {
+
+constexpr qicTypeId fnv1a(const char *s, qicTypeId h = 14695981039346656037ull)
+{
+    return *s ? fnv1a(s + 1, (h ^ (unsigned char)*s) * 1099511628211ull) : h;
+}
+
+template<class T>
+struct identity
+{
+    typedef T type;
+};
+
+template<class T>
+void destroy(void *ptr)
+{
+    delete static_cast<T *>(ptr);
+}
+
+// Counts a call in flight for the duration of a scope, so that the library
+// that implements the function is not unloaded before the call returns.
+// The runtime replaces the implementation in the slot before it reads the
+// count, so either it sees this call, or this call sees the replacement and
+// counts itself on that instead. impl is null if the function is not
+// exported, e.g. because the code that exported it has been unloaded.
+struct call_guard
+{
+    qicFunctionImpl *impl;
+
+    explicit call_guard(qicFunctionSlot *slot)
+    {
+        while (true) {
+            impl = slot ? slot->impl.load() : nullptr;
+            if (!impl) {
+                break;
+            }
+            impl->calls.fetch_add(1);
+            if (slot->impl.load() == impl) {
+                break;
+            }
+            impl->calls.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    ~call_guard()
+    {
+        if (impl) {
+            impl->calls.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    call_guard(const call_guard &) = delete;
+    call_guard &operator=(const call_guard &) = delete;
+};
+
+// Calls fn and stores its result, if any, in *result.
+template<class R>
+struct invoke
+{
+    template<class F, class... Args>
+    static void call(R *result, F fn, Args&&... args)
+    {
+        R r = fn(std::forward<Args>(args)...);
+        if (result) {
+            *result = std::move(r);
+        }
+    }
+};
+
+template<>
+struct invoke<void>
+{
+    template<class F, class... Args>
+    static void call(void *, F fn, Args&&... args)
+    {
+        fn(std::forward<Args>(args)...);
+    }
+};
+
+} // namespace qic_detail
+
+template<class T>
+constexpr qicTypeId qicTypeOf()
+{
+#ifdef _MSC_VER
+    return qic_detail::fnv1a(__FUNCSIG__);
+#else
+    return qic_detail::fnv1a(__PRETTY_FUNCTION__);
+#endif
+}
+
+/**
+    \class qicFunction
+    Calls a function exported by runtime-compiled code through its
+    qicFunctionSlot, obtained from qicContext::function<F>(). Each call goes
+    to the most recently exported implementation. A call costs an indirect
+    call plus a few uncontended atomic operations, which keep the library of
+    the implementation loaded until the call returns. Check isValid() before
+    calling: calling a function that has not been exported yet is undefined
+    behavior.
+
+        qicFunction<void(QPainter*)> paint = ctx->function<void(QPainter*)>("paint");
+        if (paint.isValid())
+            paint(&painter);
+
+    The function may be unexported between isValid() and the call when the
+    code that exported it is unloaded on another thread. Where that can
+    happen, use tryCall(), which checks and calls in one step and returns
+    `false` instead of calling a function that is not exported:
+
+        int area = 0;
+        if (!measure.tryCall(&area, rect))
+            area = rect.width() * rect.height();
+ */
+template<class F>
+class qicFunction;
+
+template<class R, class... Args>
+class qicFunction<R(Args...)>
+{
+public:
+    qicFunction(qicFunctionSlot *slot = nullptr) : slot(slot) {}
+
+    bool isValid() const
+    {
+        return slot && slot->impl.load(std::memory_order_acquire);
+    }
+
+    R operator()(Args... args) const
+    {
+        qic_detail::call_guard guard(slot);
+        assert(guard.impl && "qicFunction called while not exported, check isValid() or use tryCall()");
+        return reinterpret_cast<R(*)(Args...)>(guard.impl->fn)(static_cast<Args>(args)...);
+    }
+
+    // Stores the result in *result unless it is null. Pass nullptr for
+    // functions returning void.
+    bool tryCall(R *result, Args... args) const
+    {
+        qic_detail::call_guard guard(slot);
+        if (!guard.impl) {
+            return false;
+        }
+        qic_detail::invoke<R>::call(result, reinterpret_cast<R(*)(Args...)>(guard.impl->fn), static_cast<Args>(args)...);
+        return true;
+    }
+
+private:
+    qicFunctionSlot *slot;
+};
+
 /**
     \class qicContext
     The qicContext pure virtual class serves as the interface for communication
@@ -28,6 +251,15 @@ SOFTWARE. */
     qicContext is passed by the runtime to qic_entry(), the main function of
     the runtime-compiled code.
 
+    The context may be used from several threads. get(), getChecked() and
+    load() take no lock and may run concurrently with code that registers
+    variables, also while the runtime loads or unloads code. get() and
+    load() never wait. getChecked() retries while a set() of the same
+    variable is storing the value and its type, which takes a few
+    instructions. The other methods are serialized by a lock. A value returned by get() may be
+    replaced right after, and the object it points to is only valid as long
+    as the code that registered it stays loaded.
+
     \fn qicContext::get()
     Retrieves an object previously stored by set().
 
@@ -35,11 +267,104 @@ SOFTWARE. */
     Registers an object with the context. This object will be accessible to
     subsequent runtime-compiled code as well as to the user of qicRuntime. If
     \a deleter function is provided, it will be used to dispose of the object
-    when the library that holds the code is unloaded. Never pass pointers to
-    local variables to set().
+    when the library that holds the code is unloaded. Runtime-compiled code
+    that sets a name again, e.g. on every run of a script, replaces its
+    previous object. The previous object stays valid, as another thread may
+    still use it, and is disposed of when the library is unloaded. Objects
+    set again by the host program shadow the previous ones. Never pass
+    pointers to local variables to set().
 
     \fn qicContext::debug()
     Prints a debug message.
+
+    \fn qicContext::version()
+    Returns the version of the interface implemented by the runtime, see
+    QIC_CONTEXT_VERSION. Available since version 2.
+
+    \fn qicContext::resolve()
+    Resolves a variable name to a handle that gives fast access to the
+    variable's current value via load(). The handle remains valid for the
+    lifetime of the context, even when the variable is set again by newer
+    code, when such a variable is removed, or when the variable has not been
+    set yet. Resolve once and use the handle in hot code instead of get().
+    Available since version 2.
+
+    \fn qicContext::load()
+    Returns the current value of the variable resolved to handle \a h, or
+    `nullptr` if it is not set. Equivalent to get() with the variable's name
+    but costs a single memory access.
+
+    \fn qicContext::get<T>()
+    Typed version of get(), e.g. `ctx->get<AppModel>("model")`. With
+    QIC_TYPE_CHECKS, returns `nullptr` and prints a warning if the variable
+    was registered by set<T>() with a different type.
+
+    \fn qicContext::set<T>()
+    Typed version of set(), e.g. `ctx->set<AppModel>(new AppModel, "model")`.
+    Takes ownership of the object, which is destroyed with `delete` when the
+    library that holds the code is unloaded. Pass `nullptr` as \a deleter to
+    register an object without taking ownership. The type must be given
+    explicitly, so that calls to the untyped set() never take ownership.
+
+    \fn qicContext::getChecked()
+    Retrieves an object and verifies it was registered with type \a type.
+    The object and its type are read together, so a concurrent set of the
+    variable with another type never yields a mistyped object. Used by
+    get<T>(). Available since version 3.
+
+    \fn qicContext::setChecked()
+    Registers an object of type \a type. Used by set<T>(). Available since
+    version 3.
+
+    \fn qicContext::exportFunction()
+    Exports function \a fn under \a name, replacing the implementation
+    exported by previously loaded code. Hosts and other scripts that
+    resolved the function call the new implementation from now on. Returns
+    `false` and prints a warning if the function was exported or resolved
+    with a different signature before. Typically called from qic_exports().
+    Available since version 4.
+
+    \fn qicContext::resolveFunction()
+    Resolves a function name to its slot, which always holds the most
+    recently exported implementation, or `nullptr` if the function has not
+    been exported yet. The slot remains valid for the lifetime of the
+    context. Returns `nullptr` and prints a warning if the function was
+    exported or resolved with a different signature before. Available since
+    version 4.
+
+    \fn qicContext::exportFunction<F>()
+    Typed version of exportFunction(), e.g.
+    `ctx->exportFunction<void(QPainter*)>("paint", &paint)`.
+
+    \fn qicContext::function<F>()
+    Resolves a function with signature F, e.g.
+    `qicFunction<void(QPainter*)> paint = ctx->function<void(QPainter*)>("paint")`.
+
+    \fn qicContext::take()
+    Removes the current value of variable \a name from the context and
+    returns it without destroying it. The caller owns the object from now
+    on, the deleter passed to set() is not called. The value shadowed by it,
+    if any, becomes visible again. Returns `nullptr` if the variable is not
+    set. Typically called from qic_save() to hand an object over to the next
+    version of the code. Available since version 5.
+
+    \fn qicContext::blob()
+    Returns a block of \a size bytes named \a name that is owned by the
+    context rather than by the code, so it survives reloads of the code
+    and is freed only when the runtime is destroyed. A new blob is zeroed
+    and \a created, if not null, is set to `true`. Later calls with the same
+    name, size and type return the same memory, so a new version of the
+    code finds the data of the previous one in place, without copying. A
+    call with a different size or type returns a new, zeroed blob. Only store
+    data that needs no destructor and does not point into the library, e.g.
+    lookup tables of plain values. Available since version 5.
+
+    \fn qicContext::blob<T>()
+    Typed version of blob(), e.g.
+    `Tables *tables = ctx->blob<Tables>("tables", &created)`. T must be
+    trivially copyable. The name and size of T are part of the identity of
+    the blob, so a change of T that changes its size gives a new, zeroed
+    blob. Rename T when changing its layout but not its size.
  */
 struct qicContext
 {
@@ -47,6 +372,71 @@ struct qicContext
     virtual void *set(void *ptr, const char *name, void(*deleter)(void*) = nullptr) = 0;
 
     virtual void debug(const char *fmt, ...) = 0;
+
+    // version 2
+
+    virtual int version() = 0;
+    virtual qicHandle resolve(const char *name) = 0;
+
+    static void *load(qicHandle h)
+    {
+        return h->ptr.load(std::memory_order_acquire);
+    }
+
+    // version 3
+
+    virtual void *getChecked(const char *name, qicTypeId type) = 0;
+    virtual void *setChecked(void *ptr, const char *name, void(*deleter)(void*), qicTypeId type) = 0;
+
+    template<class T>
+    T *get(const char *name)
+    {
+#ifdef QIC_TYPE_CHECKS
+        return static_cast<T *>(getChecked(name, qicTypeOf<T>()));
+#else
+        return static_cast<T *>(get(name));
+#endif
+    }
+
+    template<class T>
+    T *set(typename qic_detail::identity<T>::type *ptr, const char *name,
+           void(*deleter)(void*) = &qic_detail::destroy<T>)
+    {
+#ifdef QIC_TYPE_CHECKS
+        return static_cast<T *>(setChecked(ptr, name, deleter, qicTypeOf<T>()));
+#else
+        return static_cast<T *>(set(ptr, name, deleter));
+#endif
+    }
+
+    // version 4
+
+    virtual bool exportFunction(const char *name, void *fn, qicTypeId type) = 0;
+    virtual qicFunctionSlot *resolveFunction(const char *name, qicTypeId type) = 0;
+
+    template<class F>
+    bool exportFunction(const char *name, F *fn)
+    {
+        return exportFunction(name, reinterpret_cast<void *>(fn), qicTypeOf<F>());
+    }
+
+    template<class F>
+    qicFunction<F> function(const char *name)
+    {
+        return qicFunction<F>(resolveFunction(name, qicTypeOf<F>()));
+    }
+
+    // version 5
+
+    virtual void *take(const char *name) = 0;
+    virtual void *blob(const char *name, size_t size, qicTypeId type, bool *created) = 0;
+
+    template<class T>
+    T *blob(const char *name, bool *created = nullptr)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "blobs hold plain data only");
+        return static_cast<T *>(blob(name, sizeof(T), qicTypeOf<T>(), created));
+    }
 };
 
 #endif // QICCONTEXT_H
@@ -34,10 +34,44 @@ struct qicContext;
 
     \fn void qic_entry(qicContext *ctx)
     Entry point exported by the runtime-compiled library. The user code must
-    define and export this function.
+    define and export this function, qic_exports(), or both.
 
         extern "C" void qic_entry(qicContext *ctx);
+
+    \fn void qic_exports(qicContext *ctx)
+    Optional entry point that exports the library's functions with
+    qicContext::exportFunction(). Called before qic_entry(). A library that
+    only replaces functions can define qic_exports() alone, so that loading
+    a new version of it does not run any initialization code again.
+
+        extern "C" void qic_exports(qicContext *ctx);
+
+    \fn void *qic_save(qicContext *ctx)
+    Optional hook called when a new version of a watched file or project has
+    been loaded, before the new version's qic_load(). Returns the state to
+    hand over to the new version, e.g. an object released with
+    qicContext::take(). The returned state must not be owned by this
+    library anymore, as the library may be unloaded afterwards. For the
+    same reason, do not hand over objects whose virtual functions are
+    defined in this library. Only called if the new version defines
+    qic_load().
+
+        extern "C" void *qic_save(qicContext *ctx);
+
+    \fn void qic_load(qicContext *ctx, void *state)
+    Optional hook called when the library is loaded, before qic_exports()
+    and qic_entry(). For a new version of a watched file or project, \a state
+    is the value returned by qic_save() of the previous version, which the
+    code takes ownership of. It is `nullptr` on the first load, for code that
+    is not watched, or if the previous version saved nothing.
+    The code must be able to interpret the state of the previous version,
+    e.g. by keeping a version number in it.
+
+        extern "C" void qic_load(qicContext *ctx, void *state);
  */
 extern "C" QIC_ENTRY_EXPORT void qic_entry(qicContext *ctx);
+extern "C" QIC_ENTRY_EXPORT void qic_exports(qicContext *ctx);
+extern "C" QIC_ENTRY_EXPORT void *qic_save(qicContext *ctx);
+extern "C" QIC_ENTRY_EXPORT void qic_load(qicContext *ctx, void *state);
 
 #endif // QICENTRY_H
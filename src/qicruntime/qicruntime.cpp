@@ -19,6 +19,16 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE. */
 
 #include <QFile>
+#include <QHash>
+#include <QSet>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QRegularExpression>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QLockFile>
+#include <QSaveFile>
+#include <QStandardPaths>
 #include <QTemporaryDir>
 #include <QTextStream>
 #include <QElapsedTimer>
@@ -26,9 +36,36 @@ SOFTWARE. */
 #include <QProcess>
 #include <QThread>
 #include <QFileSystemWatcher>
+#include <QTimer>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QPointer>
+#include <QtEndian>
+#include <QMutex>
+#include <QRecursiveMutex>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QSharedPointer>
+#include <QThreadPool>
+#include <QVector>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
 #include "qicruntime.h"
 #include "qiccontext.h"
 
+#ifdef Q_OS_LINUX
+#include <sys/mman.h>
+#endif
+#ifdef Q_OS_WIN
+#include <qt_windows.h>
+#include <tlhelp32.h>
+#else
+#include <signal.h>
+#include <unistd.h>
+#endif
+
 
 struct qicVar
 {
@@ -37,18 +74,206 @@ struct qicVar
     void (*deleter)(void *) = nullptr;
 };
 
+struct qicFunctionBinding;
+
+struct qicExport
+{
+    qicFunctionBinding *binding;
+    qicFunctionImpl *impl;
+};
+
+typedef void (*qic_entry_f)(qicContext *);
+typedef void *(*qic_save_f)(qicContext *);
+typedef void (*qic_load_f)(qicContext *, void *);
+
 struct qicFrame
 {
+    quint64 id = 0;
     QLibrary *lib = nullptr;
+    qic_entry_f entry_fn = nullptr;
+    qic_entry_f exports_fn = nullptr;
+    bool exported = false;      // exports_fn has been called
+    qic_save_f save_fn = nullptr;
+    qic_load_f load_fn = nullptr;
+    bool saved = false;         // save_fn has been called
+    QString origin;             // watched file or project the code was built from
+    bool pinned = false;        // a qicScript handle keeps the frame loaded
+    bool retired = false;       // functions unexported, waiting for calls in flight
+    int memfd = -1;             // memory file the library was loaded from
+    QString map_name;           // name of the memory file in /proc/self/maps
+    QLibrary *fast_lib = nullptr; // tier 1 or instrumented build replaced by lib
+    bool profiled = false;      // lib is a profile-guided build
+    int fast_memfd = -1;
+    // time spent in qic_entry(), since the last swap and before it
+    int runs = 0;
+    qint64 run_time = 0;
+    int runs_before = 0;
+    qint64 run_time_before = 0;
     std::vector<qicVar> vars;
+    std::vector<qicVar> replaced; // values replaced by set(), other threads may still use them
+    std::vector<qicExport> exports;
+};
+
+// All implementations of one exported function in the order they were
+// exported. The most recent one is the current target of the slot.
+// Implementations live as long as the binding, as a caller may have read
+// one from the slot just before it was replaced.
+struct qicFunctionBinding
+{
+    struct Entry
+    {
+        quint64 frame;
+        qicFunctionImpl *impl;
+    };
+
+    qicFunctionSlot slot;
+    qicTypeId type = 0;         // signature, fixed once exported or resolved
+    std::vector<Entry> stack;
+    std::vector<std::unique_ptr<qicFunctionImpl>> impls;
+};
+
+// Memory owned by the context that outlives the frames, see
+// qicContext::blob().
+struct qicBlob
+{
+    void *ptr = nullptr;
+    size_t size = 0;
+    qicTypeId type = 0;
+};
+
+// All bindings of one variable name in the order they were set. The most
+// recent binding is the current value of the variable.
+struct qicBinding
+{
+    struct Entry
+    {
+        quint64 frame;
+        void *ptr;
+        qicTypeId type;         // 0 if not known
+    };
+
+    QByteArray name;
+    size_t hash = 0;            // qHash() of name
+    qicSlot slot;               // current value, same as stack.back().ptr
+    std::atomic<qicTypeId> type { 0 }; // current type, same as stack.back().type
+    std::atomic<unsigned> version { 0 }; // odd while slot and type are being updated
+    std::vector<Entry> stack;
+
+    // Sets the current value and type. A sequence lock, so that checked
+    // readers see the value and type of the same update without locking, see
+    // read(). Writers are serialized by the context's mutex.
+    void publish(void *ptr, qicTypeId t)
+    {
+        const unsigned v = version.load(std::memory_order_relaxed);
+        version.store(v + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        type.store(t, std::memory_order_relaxed);
+        slot.ptr.store(ptr, std::memory_order_release);
+        version.store(v + 2, std::memory_order_release);
+    }
+
+    // Returns the current value and its type. Retries while a writer is
+    // between the two stores.
+    void *read(qicTypeId *t) const
+    {
+        while (true) {
+            const unsigned v = version.load(std::memory_order_acquire);
+            if (v & 1) {
+                continue;
+            }
+            *t = type.load(std::memory_order_relaxed);
+            void *ptr = slot.ptr.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (version.load(std::memory_order_relaxed) == v) {
+                return ptr;
+            }
+        }
+    }
+};
+
+// Index of variable bindings by name, an open addressing hash table that
+// readers search without locking. Bindings are only ever added, each with a
+// single atomic store, by writers serialized by the context's mutex. A full
+// table is replaced by one twice the size. Readers may still be searching
+// the old table, so it is kept, which at most doubles the memory used.
+struct qicNameTable
+{
+    size_t mask;
+    size_t count = 0;
+    std::unique_ptr<std::atomic<qicBinding *>[]> slots;
+    qicNameTable *prev;         // replaced table
+
+    qicNameTable(size_t size, qicNameTable *prev) :
+        mask(size - 1), slots(new std::atomic<qicBinding *>[size]), prev(prev)
+    {
+        for (size_t i = 0; i < size; ++i) {
+            slots[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~qicNameTable()
+    {
+        delete prev;
+    }
+
+    // The table is at most half full, so the search ends at an empty slot
+    // after a bounded number of steps.
+    qicBinding *find(const QByteArray &name, size_t hash) const
+    {
+        for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+            qicBinding *b = slots[i].load(std::memory_order_acquire);
+            if (!b || (b->hash == hash && b->name == name)) {
+                return b;
+            }
+        }
+    }
+
+    void insert(qicBinding *b)
+    {
+        size_t i = b->hash & mask;
+        while (slots[i].load(std::memory_order_relaxed)) {
+            i = (i + 1) & mask;
+        }
+        slots[i].store(b, std::memory_order_release);
+        ++count;
+    }
+
+    bool isFull() const
+    {
+        return (count + 1) * 2 > mask + 1;
+    }
 };
 
 
+// The context may be used from several threads. Lookups by name and through
+// handles do not lock. Everything else locks the mutex, which is recursive,
+// as deleters of variables may call back into the context. Frames are only
+// added and removed by the runtime's thread, which may therefore read the
+// frame stack without locking.
 struct qicContextImpl : public qicContext
 {
+    QRecursiveMutex mutex;
+
     // Stack of context frames. A frame holds the library that contains the
     // runtime-compiled code and any variables this code may have registered.
     std::vector<qicFrame> frames;
+    quint64 next_frame = 0;
+
+    // Frame that receives the variables and functions registered by the
+    // code being run, the most recent frame if null.
+    qicFrame *active_frame = nullptr;
+
+    // Index of variables by name, so that lookups do not depend on the number
+    // of frames and variables.
+    std::atomic<qicNameTable *> index { new qicNameTable(64, nullptr) };
+
+    // Exported functions by name.
+    QHash<QByteArray, qicFunctionBinding *> functions;
+
+    // Blobs by name. Blobs replaced by a blob of a different size or type
+    // are kept until the context is destroyed, older code may still use them.
+    QHash<QByteArray, qicBlob> blobs;
+    std::vector<void *> retired_blobs;
 
     // Unload libs in destructor.
     bool unloadLibs = true;
@@ -56,151 +281,3559 @@ struct qicContextImpl : public qicContext
     qicContextImpl()
     {
         // push one empty frame to hold user defined global variables
-        frames.push_back(qicFrame());
+        pushFrame(nullptr);
     }
 
     ~qicContextImpl()
     {
         // unload libs in reverse order
         for (auto fit = frames.rbegin(); fit != frames.rend(); ++fit) {
-            // destroy lib vars in reverse order before unload
-            for (auto vit = fit->vars.rbegin(); vit != fit->vars.rend(); ++vit) {
-                ::free(vit->name);
-                if (vit->deleter) {
-                    vit->deleter(vit->ptr);
-                }
+            releaseFrame(*fit, unloadLibs);
+        }
+
+        qicNameTable *table = index.load();
+        for (size_t i = 0; i <= table->mask; ++i) {
+            delete table->slots[i].load();
+        }
+        delete table;
+        qDeleteAll(functions);
+        for (const qicBlob &blob : blobs) {
+            ::free(blob.ptr);
+        }
+        for (void *ptr : retired_blobs) {
+            ::free(ptr);
+        }
+    }
+
+    // Unexports the frame's functions, so that no new call enters them.
+    // Calls already in flight keep the frame busy until they return.
+    void retireFrame(qicFrame &frame)
+    {
+        QMutexLocker lock(&mutex);
+        if (frame.retired) {
+            return;
+        }
+        for (auto eit = frame.exports.rbegin(); eit != frame.exports.rend(); ++eit) {
+            unexport(frame.id, *eit);
+        }
+        frame.retired = true;
+    }
+
+    // Unexports the frame's functions, destroys the frame's variables in
+    // reverse order, removes them from the index and unloads the frame's
+    // library.
+    void releaseFrame(qicFrame &frame, bool unload)
+    {
+        retireFrame(frame);
+        frame.exports.clear();
+
+        // destroy lib vars in reverse order before unload
+        for (auto vit = frame.vars.rbegin(); vit != frame.vars.rend(); ++vit) {
+            unbind(frame.id, *vit);
+            ::free(vit->name);
+            if (vit->deleter) {
+                vit->deleter(vit->ptr);
             }
-            if (fit->lib) {
-                if (unloadLibs) {
-                    fit->lib->unload();
+        }
+        frame.vars.clear();
+        for (auto vit = frame.replaced.rbegin(); vit != frame.replaced.rend(); ++vit) {
+            vit->deleter(vit->ptr);
+        }
+        frame.replaced.clear();
+
+        // objects created by the code of the tier 1 build may have lived
+        // until now, so it is unloaded last
+        for (QLibrary **lib : { &frame.lib, &frame.fast_lib }) {
+            if (*lib) {
+                if (unload) {
+                    (*lib)->unload();
                 }
-                delete fit->lib;
+                delete *lib;
+                *lib = nullptr;
+            }
+        }
+#ifdef Q_OS_LINUX
+        for (int *fd : { &frame.memfd, &frame.fast_memfd }) {
+            if (*fd >= 0) {
+                ::close(*fd);
+                *fd = -1;
             }
         }
+#endif
     }
 
-    void *get(const char *name) override
+    // Removes a frame from the stack. Variables previously shadowed by the
+    // frame's variables become visible again. The frame must be retired and
+    // not busy.
+    void removeFrame(size_t i)
     {
-        // search context frames and their variables in reverse order - most
-        // recently set variables override previously set variables
-        for (auto fit = frames.rbegin(); fit != frames.rend(); ++fit) {
-            for (auto vit = fit->vars.rbegin(); vit != fit->vars.rend(); ++vit) {
-                if (0 == ::strcmp(name, vit->name)) {
-                    return vit->ptr;
-                }
+        QMutexLocker lock(&mutex);
+        Q_ASSERT(i > 0 && i < frames.size());
+        releaseFrame(frames[i], true);
+        frames.erase(frames.begin() + i);
+    }
+
+    // Retires the frame and removes it, unless a call into one of its
+    // functions is still in flight. Returns false if the frame was kept.
+    bool tryRemoveFrame(size_t i)
+    {
+        QMutexLocker lock(&mutex);
+        retireFrame(frames[i]);
+        if (isBusy(frames[i])) {
+            return false;
+        }
+        removeFrame(i);
+        return true;
+    }
+
+    // Returns true if none of the frame's variables is visible, i.e. the
+    // frame registered no variables or all of them have been shadowed.
+    bool isIdle(const qicFrame &frame) const
+    {
+        for (const qicVar &var : frame.vars) {
+            const qicBinding *b = lookup(var.name);
+            if (b && !b->stack.empty() && b->stack.back().frame == frame.id) {
+                return false;
+            }
+        }
+        for (const qicExport &e : frame.exports) {
+            const qicFunctionBinding *b = e.binding;
+            if (!b->stack.empty() && b->stack.back().frame == frame.id) {
+                return false;
             }
         }
+        return true;
+    }
 
-        return nullptr;
+    // Returns true if a function exported by the frame is executing. Only
+    // meaningful once the frame is retired, before that new calls may enter
+    // the functions at any time.
+    bool isBusy(const qicFrame &frame) const
+    {
+        for (const qicExport &e : frame.exports) {
+            if (e.impl->calls.load() != 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Removes the function implementation from its binding and restores the
+    // implementation it has replaced, if any.
+    void unexport(quint64 frame, const qicExport &e)
+    {
+        qicFunctionBinding *b = e.binding;
+        for (auto it = b->stack.end(); it != b->stack.begin(); ) {
+            --it;
+            if (it->frame == frame && it->impl == e.impl) {
+                b->stack.erase(it);
+                break;
+            }
+        }
+        b->slot.impl.store(b->stack.empty() ? nullptr : b->stack.back().impl);
+    }
+
+    // Removes the variable from its binding and restores the value it has
+    // shadowed, if any.
+    void unbind(quint64 frame, const qicVar &var)
+    {
+        qicBinding *b = lookup(var.name);
+        if (!b) {
+            return;
+        }
+        for (auto e = b->stack.end(); e != b->stack.begin(); ) {
+            --e;
+            if (e->frame == frame && e->ptr == var.ptr) {
+                b->stack.erase(e);
+                break;
+            }
+        }
+        const qicBinding::Entry *top = b->stack.empty() ? nullptr : &b->stack.back();
+        b->publish(top ? top->ptr : nullptr, top ? top->type : 0);
+    }
+
+    // Returns the frame with the given id, or null if it has been unloaded.
+    // Frame ids increase monotonically, so the stack is sorted by id.
+    qicFrame *findFrame(quint64 id)
+    {
+        auto it = std::lower_bound(frames.begin(), frames.end(), id,
+                                   [](const qicFrame &f, quint64 id) { return f.id < id; });
+        return it != frames.end() && it->id == id ? &*it : nullptr;
+    }
+
+    qicFrame &currentFrame()
+    {
+        return active_frame ? *active_frame : frames.back();
+    }
+
+    // Sets the frame that receives the variables registered from now on.
+    void activate(qicFrame *frame)
+    {
+        QMutexLocker lock(&mutex);
+        active_frame = frame;
+    }
+
+    void pushFrame(QLibrary *lib)
+    {
+        QMutexLocker lock(&mutex);
+        qicFrame frame;
+        frame.id = next_frame++;
+        frame.lib = lib;
+        frames.push_back(frame);
+    }
+
+    // Returns the binding of the variable name or null. Does not lock.
+    qicBinding *lookup(const char *name) const
+    {
+        const QByteArray key = QByteArray::fromRawData(name, int(::strlen(name)));
+        return index.load(std::memory_order_acquire)->find(key, qHash(key));
+    }
+
+    void *get(const char *name) override
+    {
+        // the index holds the most recently set value of each variable,
+        // which overrides previously set variables
+        qicBinding *b = lookup(name);
+        return b ? load(&b->slot) : nullptr;
     }
 
     void *set(void *ptr, const char *name, void(*deleter)(void*)) override
     {
+        return setChecked(ptr, name, deleter, 0);
+    }
+
+    int version() override
+    {
+        return QIC_CONTEXT_VERSION;
+    }
+
+    qicHandle resolve(const char *name) override
+    {
+        return &binding(name)->slot;
+    }
+
+    void *getChecked(const char *name, qicTypeId type) override
+    {
+        qicBinding *b = lookup(name);
+        if (!b) {
+            return nullptr;
+        }
+        // the value and its type are read together, a concurrent set() of
+        // another type cannot slip a mistyped value past the check
+        qicTypeId current;
+        void *ptr = b->read(&current);
+        if (current != 0 && current != type) {
+            qWarning("qicContext: Variable %s was registered with a different type.", name);
+            return nullptr;
+        }
+        return ptr;
+    }
+
+    void *setChecked(void *ptr, const char *name, void(*deleter)(void*), qicTypeId type) override
+    {
+        QMutexLocker lock(&mutex);
         Q_ASSERT(frames.empty() == false);
-        frames.back().vars.push_back({ ptr, strdup(name), deleter });
+        qicFrame &frame = currentFrame();
+        qicBinding *b = binding(name);
+
+        // a variable set again by the code of the same frame, e.g. on every
+        // run() of a script, replaces the frame's previous value instead of
+        // piling up bindings. Variables of the host are stacked as before.
+        auto e = std::find_if(b->stack.rbegin(), b->stack.rend(),
+                              [&frame](const qicBinding::Entry &e) { return e.frame == frame.id; });
+        qicVar *var = nullptr;
+        if (frame.lib && e != b->stack.rend()) {
+            for (qicVar &v : frame.vars) {
+                if (v.ptr == e->ptr && ::strcmp(v.name, name) == 0) {
+                    var = &v;
+                    break;
+                }
+            }
+        }
+        if (!var) {
+            frame.vars.push_back({ ptr, strdup(name), deleter });
+            b->stack.push_back({ frame.id, ptr, type });
+            b->publish(ptr, type);
+            return ptr;
+        }
+
+        void *const old = var->ptr;
+        void (*const old_deleter)(void *) = var->deleter;
+        var->ptr = ptr;
+        var->deleter = deleter;
+        e->ptr = ptr;
+        e->type = type;
+        if (e == b->stack.rbegin()) {
+            b->publish(ptr, type);
+        }
+        // readers on other threads may still hold the previous value, so it
+        // is destroyed with the frame
+        if (old_deleter && old != ptr) {
+            frame.replaced.push_back({ old, nullptr, old_deleter });
+        }
         return ptr;
     }
 
-    void debug(const char *fmt, ...) override
+    bool exportFunction(const char *name, void *fn, qicTypeId type) override
+    {
+        QMutexLocker lock(&mutex);
+        Q_ASSERT(frames.empty() == false);
+        qicFunctionBinding *b = functionBinding(name);
+        if (b->type != 0 && b->type != type) {
+            qWarning("qicContext: Function %s was exported with a different signature.", name);
+            return false;
+        }
+        qicFrame &frame = currentFrame();
+        b->impls.emplace_back(new qicFunctionImpl);
+        qicFunctionImpl *impl = b->impls.back().get();
+        impl->fn = fn;
+        frame.exports.push_back({ b, impl });
+        b->stack.push_back({ frame.id, impl });
+        b->type = type;
+        b->slot.impl.store(impl);
+        return true;
+    }
+
+    qicFunctionSlot *resolveFunction(const char *name, qicTypeId type) override
+    {
+        QMutexLocker lock(&mutex);
+        qicFunctionBinding *b = functionBinding(name);
+        if (b->type != 0 && b->type != type) {
+            qWarning("qicContext: Function %s was exported with a different signature.", name);
+            return nullptr;
+        }
+        b->type = type;
+        return &b->slot;
+    }
+
+    void *take(const char *name) override
+    {
+        QMutexLocker lock(&mutex);
+        qicBinding *b = lookup(name);
+        if (!b || b->stack.empty()) {
+            return nullptr;
+        }
+        const qicBinding::Entry top = b->stack.back();
+        qicFrame *frame = findFrame(top.frame);
+        if (!frame) {
+            return nullptr;
+        }
+        for (auto vit = frame->vars.end(); vit != frame->vars.begin(); ) {
+            --vit;
+            if (vit->ptr == top.ptr && ::strcmp(vit->name, name) == 0) {
+                // the caller owns the value from now on, the deleter is not called
+                unbind(frame->id, *vit);
+                ::free(vit->name);
+                frame->vars.erase(vit);
+                return top.ptr;
+            }
+        }
+        return nullptr;
+    }
+
+    void *blob(const char *name, size_t size, qicTypeId type, bool *created) override
+    {
+        QMutexLocker lock(&mutex);
+        qicBlob &b = blobs[QByteArray(name)];
+        const bool fresh = !b.ptr || b.size != size || b.type != type;
+        if (fresh) {
+            if (b.ptr) {
+                qWarning("qicContext: Blob %s was allocated with a different size or type, "
+                         "replacing it with an empty one.", name);
+                retired_blobs.push_back(b.ptr);
+            }
+            // zeroed, so that the code can tell an empty blob
+            b.ptr = ::calloc(1, size ? size : 1);
+            b.size = size;
+            b.type = type;
+        }
+        if (created) {
+            *created = fresh;
+        }
+        return b.ptr;
+    }
+
+    qicFunctionBinding *functionBinding(const char *name)
+    {
+        qicFunctionBinding *&b = functions[QByteArray(name)];
+        if (!b) {
+            b = new qicFunctionBinding;
+        }
+        return b;
+    }
+
+    // Returns the binding of the variable name, creating an empty one if the
+    // variable has not been set yet. Bindings live as long as the context, so
+    // that handles to their slots remain valid.
+    qicBinding *binding(const char *name)
+    {
+        QMutexLocker lock(&mutex);
+        const QByteArray key(name);
+        const size_t hash = qHash(key);
+        qicNameTable *table = index.load(std::memory_order_relaxed);
+        if (qicBinding *b = table->find(key, hash)) {
+            return b;
+        }
+        if (table->isFull()) {
+            qicNameTable *bigger = new qicNameTable((table->mask + 1) * 2, table);
+            for (size_t i = 0; i <= table->mask; ++i) {
+                if (qicBinding *b = table->slots[i].load(std::memory_order_relaxed)) {
+                    bigger->insert(b);
+                }
+            }
+            index.store(bigger, std::memory_order_release);
+            table = bigger;
+        }
+        qicBinding *b = new qicBinding;
+        b->name = key;
+        b->hash = hash;
+        table->insert(b);
+        return b;
+    }
+
+    void debug(const char *fmt, ...) override
+    {
+        char buff[1024];
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(buff, 1024, fmt, args);
+        va_end(args);
+        qDebug("%s", buff);
+    }
+};
+
+
+// Persistent build cache that survives process restarts and may be shared by
+// several processes. Libraries are stored as <key>.lib files next to an index
+// that records their size and last use time, so that the cache can be loaded
+// without scanning the directory. The index is guarded by a lock file and
+// always replaced atomically. Each process merges its changes into the index
+// and evicts least recently used libraries when the size limit is exceeded.
+class qicDiskCache
+{
+public:
+    struct Entry
+    {
+        qint64 size = 0;
+        qint64 used = 0;    // last use, ms since epoch
+    };
+
+    QString path;
+    qint64 max_size = Q_INT64_C(1024) * 1024 * 1024;
+    QHash<QByteArray, Entry> index;
+    bool dirty = false;
+    int evictions = 0;
+
+    ~qicDiskCache()
+    {
+        close();
+    }
+
+    bool isOpen() const
+    {
+        return !path.isEmpty();
+    }
+
+    bool open(const QString &dirpath)
+    {
+        close();
+        if (!QDir().mkpath(dirpath)) {
+            return false;
+        }
+        path = QDir(dirpath).absolutePath();
+        QLockFile lock(filePath("index.lock"));
+        if (!lock.lock()) {
+            path.clear();
+            return false;
+        }
+        index = readIndex();
+        return true;
+    }
+
+    void close()
+    {
+        if (isOpen() && dirty) {
+            sync();
+        }
+        path.clear();
+        index.clear();
+        dirty = false;
+    }
+
+    QString filePath(const QString &name) const
+    {
+        return path + QChar('/') + name;
+    }
+
+    QString libPath(const QByteArray &key) const
+    {
+        return filePath(QString::fromLatin1(key) + ".lib");
+    }
+
+    QString depsPath(const QByteArray &key) const
+    {
+        return filePath(QString::fromLatin1(key) + ".deps");
+    }
+
+    // Reads the headers the cached library was built from and the time the
+    // build started. Returns false if the library has no dependency record.
+    bool readDeps(const QByteArray &key, QStringList *deps, qint64 *built) const
+    {
+        QFile f(depsPath(key));
+        if (!f.open(QIODevice::ReadOnly)) {
+            return false;
+        }
+        const QList<QByteArray> header = f.readLine().trimmed().split(' ');
+        if (header.size() != 3 || header[0] != "qic-deps" || header[1] != "1") {
+            return false;
+        }
+        *built = header[2].toLongLong();
+        deps->clear();
+        while (!f.atEnd()) {
+            const QByteArray line = f.readLine().trimmed();
+            if (!line.isEmpty()) {
+                *deps << QString::fromUtf8(line);
+            }
+        }
+        return true;
+    }
+
+    // Returns path to the cached library or empty string.
+    QString lookup(const QByteArray &key)
+    {
+        QString fp = libPath(key);
+        auto it = index.find(key);
+        if (it == index.end()) {
+            // might have been added by another process since we loaded the index
+            QFileInfo fi(fp);
+            if (!fi.exists()) {
+                return QString();
+            }
+            Entry e;
+            e.size = fi.size();
+            it = index.insert(key, e);
+        }
+        it->used = QDateTime::currentMSecsSinceEpoch();
+        dirty = true;
+        return fp;
+    }
+
+    void remove(const QByteArray &key)
+    {
+        index.remove(key);
+    }
+
+    bool store(const QByteArray &key, const QString &lib, const QStringList &deps, qint64 built)
+    {
+        // the dependency record goes first, so that a library is never
+        // visible without it
+        QSaveFile fdeps(depsPath(key));
+        if (!fdeps.open(QIODevice::WriteOnly)) {
+            return false;
+        }
+        fdeps.write("qic-deps 1 " + QByteArray::number(built) + '\n');
+        for (const QString &dep : deps) {
+            fdeps.write(dep.toUtf8() + '\n');
+        }
+        if (!fdeps.commit()) {
+            return false;
+        }
+
+        // copy under a private name and rename, so other processes never see
+        // a partially written library
+        QString fp = libPath(key);
+        QString tmp = QString("%1.%2-%3.tmp").arg(fp)
+                .arg(QCoreApplication::applicationPid())
+                .arg(quintptr(QThread::currentThreadId()));
+        QFile::remove(tmp);
+        if (!QFile::copy(lib, tmp)) {
+            return false;
+        }
+        if (!QFile::rename(tmp, fp)) {
+            // another process has stored the same library in the meantime
+            QFile::remove(tmp);
+        }
+
+        Entry e;
+        e.size = QFileInfo(fp).size();
+        e.used = QDateTime::currentMSecsSinceEpoch();
+        index.insert(key, e);
+        dirty = true;
+        return sync();
+    }
+
+    // Merges the in-memory index with the index on disk, evicts least recently
+    // used libraries and writes the result back.
+    bool sync()
+    {
+        QLockFile lock(filePath("index.lock"));
+        if (!lock.lock()) {
+            return false;
+        }
+
+        const QHash<QByteArray, Entry> disk = readIndex();
+        for (auto it = disk.cbegin(); it != disk.cend(); ++it) {
+            auto mine = index.find(it.key());
+            if (mine == index.end()) {
+                index.insert(it.key(), it.value());
+            } else if (it->used > mine->used) {
+                mine->used = it->used;
+            }
+        }
+        // entries we know about but the index on disk does not, were either
+        // added by us or evicted by another process
+        for (auto it = index.begin(); it != index.end(); ) {
+            if (!disk.contains(it.key()) && !QFileInfo::exists(libPath(it.key()))) {
+                it = index.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        evict();
+
+        QSaveFile f(filePath("index"));
+        if (!f.open(QIODevice::WriteOnly)) {
+            return false;
+        }
+        {
+            using Qt::endl;
+            QTextStream t(&f);
+            t << "qic-cache 1" << endl;
+            for (auto it = index.cbegin(); it != index.cend(); ++it) {
+                t << it.key() << ' ' << it->size << ' ' << it->used << endl;
+            }
+        }
+        if (!f.commit()) {
+            return false;
+        }
+        dirty = false;
+        return true;
+    }
+
+private:
+    QHash<QByteArray, Entry> readIndex() const
+    {
+        QHash<QByteArray, Entry> result;
+        QFile f(filePath("index"));
+        if (!f.open(QIODevice::ReadOnly)) {
+            return result;
+        }
+        if (f.readLine().trimmed() != "qic-cache 1") {
+            return result;
+        }
+        while (!f.atEnd()) {
+            const QList<QByteArray> fields = f.readLine().trimmed().split(' ');
+            if (fields.size() != 3) continue;
+            Entry e;
+            e.size = fields[1].toLongLong();
+            e.used = fields[2].toLongLong();
+            result.insert(fields[0], e);
+        }
+        return result;
+    }
+
+    void evict()
+    {
+        qint64 total = 0;
+        for (const Entry &e : index) {
+            total += e.size;
+        }
+        if (total <= max_size) {
+            return;
+        }
+
+        QList<QByteArray> keys = index.keys();
+        std::sort(keys.begin(), keys.end(), [this](const QByteArray &a, const QByteArray &b) {
+            return index.value(a).used < index.value(b).used;
+        });
+        for (const QByteArray &key : keys) {
+            if (total <= max_size) break;
+            total -= index.value(key).size;
+            QFile::remove(libPath(key));
+            QFile::remove(depsPath(key));
+            index.remove(key);
+            evictions++;
+        }
+    }
+};
+
+
+// Compiler and linker command line of a build configuration. Used to build
+// a library with a single compiler invocation, without qmake and make.
+struct qicToolchain
+{
+    QString cxx;            // compiler driver
+    QStringList cflags;     // compiler flags, defines and include path
+    QStringList lflags;     // linker flags and libraries
+    bool msvc = false;
+
+    bool isValid() const
+    {
+        return !cxx.isEmpty();
+    }
+
+    bool isClang() const
+    {
+        return QFileInfo(cxx).fileName().contains("clang");
+    }
+
+    // Include directories passed to the compiler.
+    QStringList includeDirs() const
+    {
+        QStringList dirs;
+        for (const QString &flag : cflags) {
+            if (flag.startsWith("-I") && flag.size() > 2) {
+                dirs << flag.mid(2);
+            }
+        }
+        return dirs;
+    }
+
+    // Arguments to compile and link source file into library. The \a libs
+    // follow the source, so that the linker keeps the ones it uses.
+    QStringList buildArgs(const QString &fncpp, const QString &fnlib, const QStringList &extra = QStringList(),
+                          const QStringList &libs = QStringList()) const
+    {
+        QStringList args = cflags + extra;
+        if (msvc) {
+            args << "-Fe" + fnlib;
+            args << "-Fo" + QFileInfo(fncpp).completeBaseName() + ".obj";
+            args << fncpp;
+            args << "/link";
+            args << lflags << libs;
+            return args;
+        }
+
+        if (fncpp == "-") {
+            // source on stdin, the inputs that follow are not C++
+            args << "-o" << fnlib << "-x" << "c++" << "-" << "-x" << "none";
+        } else {
+            args << "-o" << fnlib << fncpp;
+        }
+        args << libs;
+        args << linkFlags(fnlib);
+        return args;
+    }
+
+    // Arguments to compile source file into object file.
+    QStringList compileArgs(const QString &fncpp, const QString &fnobj, const QStringList &extra = QStringList()) const
+    {
+        QStringList args = cflags + extra;
+        if (msvc) {
+            args << "-c" << "-Fo" + fnobj << fncpp;
+        } else {
+            args << "-c" << "-o" << fnobj << fncpp;
+        }
+        return args;
+    }
+
+    // Arguments to link object files into library.
+    QStringList linkArgs(const QStringList &objects, const QString &fnlib) const
+    {
+        QStringList args;
+        if (msvc) {
+            args << "-Fe" + fnlib << objects << "/link" << lflags;
+            return args;
+        }
+        args << "-o" << fnlib << objects;
+        args << linkFlags(fnlib);
+        return args;
+    }
+
+    // Linker flags for library, with the probe project's library name
+    // replaced.
+    QStringList linkFlags(const QString &fnlib) const
+    {
+        QStringList args;
+        const QString libname = QFileInfo(fnlib).fileName();
+        for (int i = 0; i < lflags.size(); ++i) {
+            // replace the probe project's library name with our own
+            const QString &flag = lflags[i];
+            if (flag.startsWith("-Wl,-soname,")) {
+                args << "-Wl,-soname," + libname;
+            } else if (flag == "-install_name" && i + 1 < lflags.size()) {
+                args << flag << "@rpath/" + libname;
+                ++i;
+            } else {
+                args << flag;
+            }
+        }
+        return args;
+    }
+
+    // Extracts the toolchain from a Makefile generated by qmake.
+    static qicToolchain fromMakefile(const QString &path)
+    {
+        QHash<QString, QString> vars;
+        QFile f(path);
+        if (!f.open(QIODevice::ReadOnly | QIODevice::Text)) {
+            return qicToolchain();
+        }
+        static const QRegularExpression rxname("^[A-Za-z_][A-Za-z0-9_]*$");
+        QString line;
+        while (!f.atEnd()) {
+            line += QString::fromLocal8Bit(f.readLine()).trimmed();
+            if (line.endsWith(QChar('\\'))) {
+                line.chop(1);
+                line += QChar(' ');
+                continue;
+            }
+            int eq = line.indexOf(QChar('='));
+            QString name = line.left(eq).trimmed();
+            if (eq > 0 && !line.startsWith(QChar('#')) && rxname.match(name).hasMatch()) {
+                vars.insert(name, line.mid(eq+1).trimmed());
+            }
+            line.clear();
+        }
+
+        qicToolchain tc;
+        tc.cxx = expand("$(CXX)", vars).trimmed();
+        tc.msvc = QFileInfo(tc.cxx).completeBaseName().compare("cl", Qt::CaseInsensitive) == 0;
+        // paths are relative to the Makefile, make them usable from any
+        // build directory
+        const QDir base = QFileInfo(path).absoluteDir();
+        tc.cflags = absolutePaths(splitArgs(expand("$(CXXFLAGS) $(INCPATH)", vars)), base);
+        tc.lflags = absolutePaths(splitArgs(expand("$(LFLAGS) $(LIBS)", vars)), base);
+        return tc;
+    }
+
+    static qicToolchain load(const QString &path)
+    {
+        qicToolchain tc;
+        QFile f(path);
+        if (f.open(QIODevice::ReadOnly)) {
+            QDataStream s(&f);
+            s >> tc.cxx >> tc.cflags >> tc.lflags >> tc.msvc;
+            if (s.status() != QDataStream::Ok) {
+                tc = qicToolchain();
+            }
+        }
+        return tc;
+    }
+
+    bool save(const QString &path) const
+    {
+        QSaveFile f(path);
+        if (!f.open(QIODevice::WriteOnly)) {
+            return false;
+        }
+        QDataStream s(&f);
+        s << cxx << cflags << lflags << msvc;
+        return f.commit();
+    }
+
+private:
+    // Expands $(NAME) references to Makefile variables.
+    static QString expand(QString value, const QHash<QString, QString> &vars, int depth = 0)
+    {
+        static const QRegularExpression rxref("\\$\\(([A-Za-z_][A-Za-z0-9_]*)\\)");
+        QRegularExpressionMatch m;
+        int pos = 0;
+        while ((m = rxref.match(value, pos)).hasMatch()) {
+            QString sub = depth < 16 ? expand(vars.value(m.captured(1)), vars, depth + 1) : QString();
+            value.replace(m.capturedStart(), m.capturedLength(), sub);
+            pos = m.capturedStart() + sub.size();
+        }
+        return value;
+    }
+
+    // Converts relative paths in include and library path options and
+    // relative paths of existing files to absolute paths. Paths within the
+    // directory of the Makefile, e.g. `-I.`, refer to the build directory
+    // of the probe and are left relative, so that they refer to the build
+    // directory of each build instead.
+    static QStringList absolutePaths(QStringList args, const QDir &base)
+    {
+        static const char *const path_opts[] = { "-I", "-L", "-F", "/LIBPATH:" };
+        const QString root = QDir::cleanPath(base.absolutePath());
+        auto absolute = [&base, &root](const QString &path) {
+            const QString abs = QDir::cleanPath(base.absoluteFilePath(path));
+            if (QDir::isRelativePath(path) && (abs == root || abs.startsWith(root + QChar('/')))) {
+                return path;
+            }
+            return abs;
+        };
+        for (int i = 0; i < args.size(); ++i) {
+            QString &arg = args[i];
+            if (arg == "-isystem" && i + 1 < args.size()) {
+                QString &next = args[++i];
+                next = absolute(next);
+                continue;
+            }
+            bool done = false;
+            for (const char *opt : path_opts) {
+                const int n = int(qstrlen(opt));
+                if (arg.startsWith(QLatin1String(opt), Qt::CaseInsensitive) && arg.size() > n) {
+                    arg = arg.left(n) + absolute(arg.mid(n));
+                    done = true;
+                    break;
+                }
+            }
+            if (!done && !arg.startsWith(QChar('-')) && !arg.startsWith(QChar('/')) &&
+                QDir::isRelativePath(arg) && base.exists(arg)) {
+                arg = absolute(arg);
+            }
+        }
+        return args;
+    }
+
+    // Splits command line arguments, honoring quotes.
+    static QStringList splitArgs(const QString &s)
+    {
+        QStringList args;
+        QString arg;
+        QChar quote;
+        bool has_arg = false;
+        for (const QChar c : s) {
+            if (!quote.isNull()) {
+                if (c == quote) {
+                    quote = QChar();
+                } else {
+                    arg += c;
+                }
+            } else if (c == QLatin1Char('"') || c == QLatin1Char('\'')) {
+                quote = c;
+                has_arg = true;
+            } else if (c.isSpace()) {
+                if (has_arg) {
+                    args << arg;
+                    arg.clear();
+                    has_arg = false;
+                }
+            } else {
+                arg += c;
+                has_arg = true;
+            }
+        }
+        if (has_arg) {
+            args << arg;
+        }
+        return args;
+    }
+};
+
+
+// Build settings. Every build works with its own copy of the settings, so the
+// settings may be changed while builds run in the background.
+struct qicBuildConfig
+{
+    QProcessEnvironment env;
+    QString qmake, make;
+    // qmake project variables
+    QStringList defines;        // DEFINES
+    QStringList include_path;   // INCLUDEPATH
+    QStringList qtlibs;         // QT
+    QStringList qtconf;         // CONFIG
+    QStringList libs;           // LIBS
+    // additional flags
+    bool autodebug = true;      // add "debug" to CONFIG automatically
+    // names of env variables explicitly set by the user
+    QSet<QString> env_overrides;
+
+    qicRuntime::BuildMode build_mode = qicRuntime::QmakeBuild;
+    bool cache = true;          // use the build cache
+    bool in_memory = false;     // avoid writing intermediates to disk
+    int timeout = 300000;       // build deadline in ms, 0 for none
+    bool tiered = false;        // build fast first, then optimized
+    int tier = 0;               // 1 for the fast build of a tiered build
+    bool pgo = false;           // profile-guided builds
+    int pgo_msec = 60000;       // profiling time
+    int pgo_runs = 0;           // profiled runs, 0 for no limit
+    QStringList pch_headers;    // headers to precompile
+
+    qicBuildConfig()
+    {
+        env = QProcessEnvironment::systemEnvironment();
+
+        qmake = "qmake"; // assume to be on PATH
+#ifdef Q_OS_WIN
+        make = "nmake";
+#else
+        make = "make";
+#endif
+    }
+
+    bool loadEnv(QString path)
+    {
+        //env.clear();
+
+        QFile f(path);
+        if (!f.open(QIODevice::ReadOnly)) {
+            return false;
+        }
+
+        while (!f.atEnd()) {
+            QString line = f.readLine().trimmed();
+            int eq = line.indexOf(QChar('='));
+            if (eq < 0) continue;
+            QString name = line.mid(0, eq);
+            QString value = line.mid(eq+1);
+            env.insert(name, value);
+            env_overrides.insert(name);
+        }
+
+        return true;
+    }
+
+    // Serializes the configuration for the build server.
+    void save(QDataStream &out) const
+    {
+        out << env.toStringList() << qmake << make
+            << defines << include_path << qtlibs << qtconf << libs
+            << autodebug << QStringList(env_overrides.values())
+            << qint32(build_mode) << cache << pch_headers << in_memory << qint32(timeout)
+            << tiered << qint32(tier);
+    }
+
+    void load(QDataStream &in)
+    {
+        QStringList envlist, overrides;
+        qint32 mode = 0, deadline = 0, build_tier = 0;
+        in >> envlist >> qmake >> make
+           >> defines >> include_path >> qtlibs >> qtconf >> libs
+           >> autodebug >> overrides
+           >> mode >> cache >> pch_headers >> in_memory >> deadline
+           >> tiered >> build_tier;
+        env.clear();
+        for (const QString &var : envlist) {
+            const int eq = var.indexOf(QChar('='), 1);
+            if (eq > 0) {
+                env.insert(var.left(eq), var.mid(eq + 1));
+            }
+        }
+        env_overrides = QSet<QString>(overrides.cbegin(), overrides.cend());
+        build_mode = qicRuntime::BuildMode(mode);
+        timeout = deadline;
+        tier = build_tier;
+    }
+
+    // Computes a key that identifies the build configuration, i.e. everything
+    // except the source code that affects the build output.
+    QByteArray configKey() const
+    {
+        static const char *const build_env[] = {
+            "PATH", "QMAKESPEC", "QTDIR", "QMAKEPATH", "QMAKEFEATURES",
+            "CC", "CXX", "CFLAGS", "CXXFLAGS", "CPPFLAGS", "LDFLAGS",
+            "CPATH", "CPLUS_INCLUDE_PATH", "LIBRARY_PATH", "MAKEFLAGS",
+            "INCLUDE", "LIB", "LIBPATH"
+        };
+
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        auto add = [&hash](const QString &s) {
+            hash.addData(s.toUtf8());
+            hash.addData(QByteArray(1, '\0'));
+        };
+        auto addList = [&add](const QString &tag, const QStringList &l) {
+            add(tag);
+            for (const QString &s : l) add(s);
+        };
+
+        add(QT_VERSION_STR);
+        add(qmake);
+        add(make);
+        addList("DEFINES", defines);
+        addList("INCLUDEPATH", include_path);
+        addList("QT", qtlibs);
+        addList("CONFIG", qtconf);
+        addList("LIBS", libs);
+#ifdef QT_DEBUG
+        add(autodebug ? "autodebug" : "");
+#endif
+
+        QSet<QString> names = env_overrides;
+        for (const char *name : build_env) {
+            names.insert(name);
+        }
+        QStringList sorted = names.values();
+        sorted.sort();
+        for (const QString &name : sorted) {
+            add(name + '=' + env.value(name));
+        }
+
+        return hash.result().toHex();
+    }
+
+    // Computes the build cache key of the source. The key covers the source
+    // text and the build configuration.
+    QByteArray buildKey(const QString &src) const
+    {
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        hash.addData(configKey());
+        // qmake and direct builds pass different flags to the compiler
+        hash.addData(QByteArray::number(int(build_mode)));
+        hash.addData(pch_headers.join(QChar('\n')).toUtf8());
+        hash.addData(src.toUtf8());
+        if (tier == 1) {
+            hash.addData("tier 1");
+        }
+        return hash.result().toHex();
+    }
+};
+
+
+// Number of timing events kept for qicRuntime::writeTrace().
+static const size_t qicTraceLimit = 100000;
+
+// Monotonic clock shared by all runtimes, in microseconds.
+static qint64 qicNow()
+{
+    static const QElapsedTimer clock = []() {
+        QElapsedTimer t;
+        t.start();
+        return t;
+    }();
+    return clock.nsecsElapsed() / 1000;
+}
+
+// One timed phase of a build and execution, see qicExecStats.
+struct qicPhase
+{
+    const char *name;
+    qint64 start;               // qicNow()
+    qint64 duration;            // microseconds
+    quintptr thread;
+};
+
+struct qicBuildJob;
+
+// Records the duration of the enclosing scope as a phase of the job.
+class qicPhaseTimer
+{
+public:
+    qicPhaseTimer(qicBuildJob &job, const char *name);
+    ~qicPhaseTimer();
+
+private:
+    qicBuildJob &job;
+    const char *name;
+    qint64 start;
+};
+
+// A single build of runtime-compiled code. Builds may run on a worker thread,
+// so the job carries everything the build needs.
+struct qicBuildJob
+{
+    int id = 0;
+    int seq = 0;                // numbers the generated files
+    QString dir;                // working directory
+    QString src;
+    qicBuildConfig conf;
+    QString lib_path;           // the built library
+    bool ok = false;
+    std::atomic<bool> cancelled { false };
+    QSemaphore finished;        // released when a batch build finishes
+    qint64 started = 0;         // build start, ms since epoch
+    qint64 deadline = 0;        // qicNow() when the build times out, 0 for none
+    quint64 upgrade_frame = 0;  // frame that receives the optimized build
+    int profile = 0;            // 1 for an instrumented build, 2 for a build using the profile
+    QStringList deps;           // headers included by the source
+    QString watch;              // watched file the source was read from
+    QStringList sources;        // source files of a project build
+    QStringList link;           // libraries of earlier REPL cells to link with
+
+    // timing
+    qint64 created = 0;         // qicNow() when the job was created
+    std::vector<qicPhase> phases;
+    bool cache_hit = false;
+    bool remote = false;        // built by the build server
+
+    QString filePath(const QString &name) const
+    {
+        return QDir(dir).filePath(name);
+    }
+
+    bool timedOut() const
+    {
+        return deadline && qicNow() > deadline;
+    }
+};
+
+
+qicPhaseTimer::qicPhaseTimer(qicBuildJob &job, const char *name) :
+    job(job), name(name), start(qicNow())
+{
+}
+
+qicPhaseTimer::~qicPhaseTimer()
+{
+    job.phases.push_back({ name, start, qicNow() - start, quintptr(QThread::currentThreadId()) });
+}
+
+// Messages exchanged with the build server are length-prefixed byte arrays.
+static const quint32 qicServerMagic = 0x71696362; // "qicb"
+static const quint32 qicServerVersion = 3;
+
+// A build server that does not answer within this time is considered hung,
+// and the build falls back to a local one.
+static const qint64 qicServerResponseTimeout = 2 * 60 * 1000;
+
+static void qicWriteMessage(QIODevice *dev, const QByteArray &msg)
+{
+    QDataStream out(dev);
+    out.setVersion(QDataStream::Qt_5_12);
+    out << msg;
+}
+
+// Reads a complete message, returns false if it has not arrived yet.
+static bool qicReadMessage(QIODevice *dev, QByteArray *msg)
+{
+    char size[4];
+    if (dev->peek(size, 4) != 4) {
+        return false;
+    }
+    const qint64 len = qFromBigEndian<quint32>(size);
+    if (dev->bytesAvailable() < 4 + len) {
+        return false;
+    }
+    dev->read(4);
+    *msg = dev->read(len);
+    return true;
+}
+
+// Source that precedes the code of every REPL cell, see execCell().
+static const char qicCellPrelude[] =
+    "#include <qicentry.h>\n"
+    "#include <qiccontext.h>\n"
+    "#ifndef QIC_CELL_EXPORT\n"
+    "#ifdef _MSC_VER\n"
+    "#define QIC_CELL_EXPORT __declspec(dllexport)\n"
+    "#define QIC_CELL_IMPORT __declspec(dllimport)\n"
+    "#else\n"
+    "#define QIC_CELL_EXPORT __attribute__((visibility(\"default\")))\n"
+    "#define QIC_CELL_IMPORT\n"
+    "#endif\n"
+    "#endif\n";
+
+// Returns the index of the first \a ch outside of parentheses, brackets and
+// braces, and with \a angles also outside of template arguments, or -1.
+static int qicTopLevelIndex(const QString &code, QChar ch, bool angles = false)
+{
+    int depth = 0;
+    for (int i = 0; i < code.size(); ++i) {
+        const QChar c = code[i];
+        if (c == ch && depth == 0) {
+            return i;
+        }
+        if (c == QChar('(') || c == QChar('[') || c == QChar('{') || (angles && c == QChar('<'))) {
+            ++depth;
+        } else if (c == QChar(')') || c == QChar(']') || c == QChar('}') || (angles && c == QChar('>'))) {
+            --depth;
+        }
+    }
+    return -1;
+}
+
+static bool qicContainsWord(const QString &code, const char *word)
+{
+    return code.contains(QRegularExpression(QString("\\b%1\\b").arg(QLatin1String(word))));
+}
+
+// Returns the name declared by a declaration without its initializer or
+// function parameters, e.g. `S::count` for `int S::count`.
+static QString qicDeclaredName(const QString &decl)
+{
+    static const QRegularExpression rx("([A-Za-z_~][\\w:~]*)\\s*(\\[[^\\]]*\\]\\s*)*$");
+    return rx.match(decl).captured(1);
+}
+
+// Splits code into its top-level declarations: preprocessor lines, and
+// everything up to a semicolon or up to the brace that closes a function or
+// namespace body. Comments and literals are skipped.
+static QStringList qicTopLevelDeclarations(const QString &code)
+{
+    QStringList decls;
+    const int n = code.size();
+    int start = 0;
+    int depth = 0;
+    bool record = false;    // a class or an initializer, ends with a semicolon
+    auto flush = [&](int end) {
+        const QString decl = code.mid(start, end - start).trimmed();
+        if (!decl.isEmpty() && decl != ";") {
+            decls << decl;
+        }
+        start = end;
+        record = false;
+    };
+    for (int i = 0; i < n; ++i) {
+        const QChar c = code[i];
+        if (c == QChar('/') && i + 1 < n && code[i + 1] == QChar('/')) {
+            const int e = code.indexOf(QChar('\n'), i);
+            i = e < 0 ? n : e;
+        } else if (c == QChar('/') && i + 1 < n && code[i + 1] == QChar('*')) {
+            const int e = code.indexOf("*/", i + 2);
+            i = e < 0 ? n : e + 1;
+        } else if (c == QChar('\'') && i > 0 && code[i - 1].isDigit()) {
+            // digit separator
+        } else if (c == QChar('"') || c == QChar('\'')) {
+            for (++i; i < n && code[i] != c; ++i) {
+                if (code[i] == QChar('\\')) {
+                    ++i;
+                }
+            }
+        } else if (c == QChar('#') && depth == 0 && code.mid(start, i - start).trimmed().isEmpty()) {
+            // up to the end of the line, including continuation lines
+            int e = i;
+            while ((e = code.indexOf(QChar('\n'), e)) > 0 && code[e - 1] == QChar('\\')) {
+                ++e;
+            }
+            i = e < 0 ? n : e;
+            flush(i);
+        } else if (c == QChar('{') || c == QChar('(') || c == QChar('[')) {
+            if (c == QChar('{') && depth == 0) {
+                QString head = code.mid(start, i - start).trimmed();
+                if (head.startsWith("template")) {
+                    // skip the template parameters
+                    int angles = 0;
+                    int j = head.indexOf(QChar('<'));
+                    for (; j >= 0 && j < head.size(); ++j) {
+                        angles += head[j] == QChar('<') ? 1 : head[j] == QChar('>') ? -1 : 0;
+                        if (angles == 0) {
+                            break;
+                        }
+                    }
+                    head = head.mid(j + 1);
+                }
+                static const QRegularExpression rxrecord("^\\s*(typedef\\s+)?(struct|class|union|enum)\\b");
+                record = rxrecord.match(head).hasMatch() || qicTopLevelIndex(head, QChar('=')) >= 0;
+            }
+            ++depth;
+        } else if (c == QChar('}') || c == QChar(')') || c == QChar(']')) {
+            --depth;
+            if (c == QChar('}') && depth == 0 && !record) {
+                flush(i + 1);
+            }
+        } else if (c == QChar(';') && depth == 0) {
+            flush(i + 1);
+        }
+    }
+    flush(n);
+    return decls;
+}
+
+// Splits the declarations of a REPL cell into the header that declares them
+// to later cells and the definitions compiled into the cell's library.
+// Functions and variables are exported from the library and declared in the
+// header. Types, templates, inline and const entities are copied into the
+// header as they are, static ones stay private to the cell. The declarations
+// are told apart by a few tokens, which suits the code typed into a REPL but
+// is no C++ parser.
+static void qicSplitCell(const QString &code, QString *header, QString *source)
+{
+    for (const QString &decl : qicTopLevelDeclarations(code)) {
+        const int brace = qicTopLevelIndex(decl, QChar('{'));
+        const QString head = brace >= 0 ? decl.left(brace).trimmed() : decl;
+        static const QRegularExpression rxword("^\\s*([A-Za-z_]\\w*)");
+        const QString word = rxword.match(head).captured(1);
+
+        // namespaces are split recursively
+        if (word == "namespace" && brace >= 0 && !head.contains(QChar('='))) {
+            const QString body = decl.mid(brace + 1, decl.lastIndexOf(QChar('}')) - brace - 1);
+            QString h, s;
+            qicSplitCell(body, &h, &s);
+            *header += head + " {\n" + h + "}\n";
+            *source += head + " {\n" + s + "}\n";
+            continue;
+        }
+
+        static const QStringList copied = {
+            "template", "struct", "class", "union", "enum", "typedef", "using",
+            "namespace", "static_assert", "extern", "const", "inline", "constexpr"
+        };
+        if (decl.startsWith(QChar('#')) || copied.contains(word) ||
+                qicContainsWord(head, "inline") || qicContainsWord(head, "constexpr")) {
+            *header += decl + "\n";
+            *source += decl + "\n";
+            continue;
+        }
+        if (qicContainsWord(head, "static")) {
+            *source += decl + "\n";
+            continue;
+        }
+
+        const int eq = qicTopLevelIndex(head, QChar('='));
+        const int paren = qicTopLevelIndex(head, QChar('('), !head.contains("operator"));
+        if (decl.endsWith(QChar('}')) && brace >= 0 && paren >= 0 && eq < 0) {
+            // function definition, members defined outside of their class
+            // are already declared by the class
+            if (qicDeclaredName(head.left(paren)).contains("::")) {
+                *source += decl + "\n";
+            } else {
+                *header += "QIC_CELL_IMPORT " + head + ";\n";
+                *source += "QIC_CELL_EXPORT " + decl + "\n";
+            }
+        } else if (paren >= 0 && eq < 0 && brace < 0) {
+            // function declaration
+            *header += decl + "\n";
+            *source += decl + "\n";
+        } else {
+            // variable definition, declared without its initializer
+            int end = decl.size() - (decl.endsWith(QChar(';')) ? 1 : 0);
+            if (eq >= 0) {
+                end = eq;
+            } else if (brace >= 0) {
+                end = brace;
+            }
+            const QString var = decl.left(end).trimmed();
+            const QString name = qicDeclaredName(var);
+            const QString def = decl.endsWith(QChar(';')) ? decl : decl + ";";
+            if (name.contains("::")) {
+                *source += def + "\n";
+            } else if (qicContainsWord(var, "auto")) {
+                qWarning("qicRuntime: Cell variable %s is declared auto and is not visible to later cells.",
+                         qPrintable(name));
+                *source += def + "\n";
+            } else {
+                *header += "extern QIC_CELL_IMPORT " + var + ";\n";
+                *source += "QIC_CELL_EXPORT " + def + "\n";
+            }
+        }
+    }
+}
+
+// Runs a build tool in a process group of its own, a job object on Windows,
+// so that stopping the tool also stops the processes it has started, e.g.
+// the compilers started by make or cc1plus started by the compiler driver.
+class qicBuildProcess : public QProcess
+{
+public:
+    qicBuildProcess()
+    {
+#if defined(Q_OS_WIN)
+        job = ::CreateJobObjectW(nullptr, nullptr);
+        if (job) {
+            JOBOBJECT_EXTENDED_LIMIT_INFORMATION info = {};
+            info.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+            ::SetInformationJobObject(job, JobObjectExtendedLimitInformation, &info, sizeof(info));
+        }
+        // the tool is resumed once it is in the job, so that it cannot
+        // start processes outside of it
+        setCreateProcessArgumentsModifier([](QProcess::CreateProcessArguments *args) {
+            args->flags |= CREATE_SUSPENDED;
+        });
+#elif QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+        setChildProcessModifier([]() { ::setpgid(0, 0); });
+#endif
+    }
+
+    ~qicBuildProcess()
+    {
+#ifdef Q_OS_WIN
+        if (job) {
+            ::CloseHandle(job);
+        }
+#endif
+    }
+
+    void startTool(const QString &program, const QStringList &arguments)
+    {
+        start(program, arguments);
+#ifdef Q_OS_WIN
+        if (waitForStarted()) {
+            const DWORD pid = DWORD(processId());
+            if (job) {
+                HANDLE process = ::OpenProcess(PROCESS_SET_QUOTA | PROCESS_TERMINATE, FALSE, pid);
+                if (process) {
+                    ::AssignProcessToJobObject(job, process);
+                    ::CloseHandle(process);
+                }
+            }
+            resumeThreads(pid);
+        }
+#endif
+    }
+
+    // Asks the tool and its children to exit, so that they can clean up
+    // their temporary files, and kills them if they do not.
+    void stop()
+    {
+#ifdef Q_OS_WIN
+        // console programs on Windows do not handle terminate()
+        if (job) {
+            ::TerminateJobObject(job, 1);
+        } else {
+            kill();
+        }
+        waitForFinished();
+#else
+        const pid_t group = pid_t(processId());
+        if (group > 0) {
+            ::kill(-group, SIGTERM);
+        }
+        if (!waitForFinished(2000)) {
+            if (group > 0) {
+                ::kill(-group, SIGKILL);
+            }
+            kill();
+            waitForFinished();
+        }
+#endif
+    }
+
+protected:
+#if !defined(Q_OS_WIN) && QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    void setupChildProcess() override
+    {
+        ::setpgid(0, 0);
+    }
+#endif
+
+private:
+#ifdef Q_OS_WIN
+    // Resumes the main thread of a process started suspended. QProcess does
+    // not expose the thread handle, so the thread is looked up by process.
+    static void resumeThreads(DWORD pid)
+    {
+        HANDLE snapshot = ::CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+        if (snapshot == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        THREADENTRY32 entry = {};
+        entry.dwSize = sizeof(entry);
+        for (BOOL more = ::Thread32First(snapshot, &entry); more; more = ::Thread32Next(snapshot, &entry)) {
+            if (entry.th32OwnerProcessID != pid) {
+                continue;
+            }
+            HANDLE thread = ::OpenThread(THREAD_SUSPEND_RESUME, FALSE, entry.th32ThreadID);
+            if (thread) {
+                ::ResumeThread(thread);
+                ::CloseHandle(thread);
+            }
+        }
+        ::CloseHandle(snapshot);
+    }
+
+    HANDLE job = nullptr;
+#endif
+};
+
+// Runs a function on a thread pool.
+class qicBuildTask : public QRunnable
+{
+public:
+    explicit qicBuildTask(std::function<void()> fn) : fn(std::move(fn))
+    {
+    }
+
+    void run() override
+    {
+        fn();
+    }
+
+private:
+    std::function<void()> fn;
+};
+
+
+class qicRuntimePrivate
+{
+public:
+    QTemporaryDir dir;
+    bool dir_set = false;       // set by setTempDir()
+    qicBuildConfig conf;
+
+    // Build cache. Maps the build key of a source to the library that was
+    // built from it and the headers it includes. Guarded by mutex.
+    struct CachedBuild
+    {
+        QString lib;
+        QStringList deps;
+        qint64 built = 0;       // build start, ms since epoch
+    };
+
+    QMutex mutex;
+    QHash<QByteArray, CachedBuild> cache;
+    qicDiskCache disk;
+    qicCacheStats cache_stats;
+
+    // Compiler flags probed for each build configuration, configurations
+    // whose Makefile yielded no flags and precompiled headers that failed to
+    // build. Guarded by probe_mutex.
+    QMutex probe_mutex;
+    QHash<QByteArray, qicToolchain> toolchains;
+    QSet<QByteArray> probe_failed;
+    QSet<QByteArray> pch_failed;
+
+    // Serializes builds of projects, which share their build directory
+    // between builds.
+    QMutex project_mutex;
+
+    // Receives the build output of a job, set by qicRuntime to emit
+    // buildOutput(). Called from the thread that runs the build.
+    std::function<void(int job, const QByteArray &text)> output;
+
+    // Build server process. Jobs are sent to the server named server_name,
+    // which is guarded by server_mutex, as builds run on worker threads.
+    QString server_program;
+    QProcess *server = nullptr;
+    QMutex server_mutex;
+    QString server_name;
+
+    // Background builds. The pool runs one build at a time, in the order the
+    // builds were started.
+    QThreadPool pool;
+    QHash<int, QSharedPointer<qicBuildJob>> jobs;
+
+    // Optimized builds of tiered builds, run beside the other builds so that
+    // they do not delay them.
+    QThreadPool upgrade_pool;
+    QHash<int, QSharedPointer<qicBuildJob>> upgrades;
+
+    // Profile-guided builds waiting for the profile, by frame.
+    QHash<quint64, QSharedPointer<qicBuildJob>> profiling;
+
+    // REPL cells, in the order they were executed, see execCell().
+    struct qicCell
+    {
+        quint64 frame;
+        QString header;         // declares the cell's declarations
+        QString link;           // library or import library to link with
+    };
+    std::vector<qicCell> cells;
+
+    int next_job = 1;
+    int next_seq = 1;
+    int max_parallel = QThread::idealThreadCount();
+
+    // frame unload policy
+    int max_frames = 0;         // keep at most this many frames, 0 = all
+    bool drop_idle = false;     // unload frames without visible variables
+
+    // Watched files. Change notifications restart the file's timer, which
+    // rebuilds the file once the changes have settled.
+    struct Watch
+    {
+        QTimer *timer = nullptr;
+        QByteArray hash;        // hash of the last executed source
+        int job = 0;            // pending background build, 0 if none
+        QByteArray job_hash;    // hash of the source of the pending build
+        QStringList deps;       // headers included by the last build
+        bool dep_changed = false;
+        QStringList project;    // source files of a watched project
+    };
+
+    // Statistics of the last exec and phases of all execs for the trace.
+    struct TraceEvent
+    {
+        const char *name;
+        qint64 start;
+        qint64 duration;
+        quintptr thread;
+        int job;
+    };
+
+    qicExecStats last_stats;
+    std::vector<TraceEvent> trace;
+
+    QFileSystemWatcher *watcher = nullptr;
+    QHash<QString, Watch> watches;
+    QHash<QString, QSet<QString>> dependents;   // header -> watched files
+    QHash<QString, int> watched_dirs;           // directory -> watched files and headers in it
+    int watch_delay = 100;
+
+    qicContextImpl ctx;
+
+    qicRuntimePrivate()
+    {
+        pool.setMaxThreadCount(1);
+        upgrade_pool.setMaxThreadCount(1);
+    }
+
+    ~qicRuntimePrivate()
+    {
+        for (const QSharedPointer<qicBuildJob> &job : jobs) {
+            job->cancelled = true;
+        }
+        for (const QSharedPointer<qicBuildJob> &job : upgrades) {
+            job->cancelled = true;
+        }
+        pool.waitForDone();
+        upgrade_pool.waitForDone();
+        stopServer();
+    }
+
+    // Starts the build server process and waits until it accepts
+    // connections. Called on the runtime's thread.
+    bool startServer()
+    {
+        stopServer();
+
+        const QString name = QString("qicbuildd-%1-%2")
+                .arg(QCoreApplication::applicationPid())
+                .arg(quintptr(this), 0, 16);
+        server = new QProcess;
+        server->setProcessChannelMode(QProcess::ForwardedChannels);
+        server->start(server_program, { "--name", name });
+        if (!server->waitForStarted()) {
+            qWarning("qicRuntime: Failed to start build server %s: %s", qPrintable(server_program), qPrintable(server->errorString()));
+            delete server;
+            server = nullptr;
+            return false;
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        while (timer.elapsed() < 5000 && server->state() == QProcess::Running) {
+            QLocalSocket socket;
+            socket.connectToServer(name);
+            if (socket.waitForConnected(100)) {
+                QMutexLocker lock(&server_mutex);
+                server_name = name;
+                return true;
+            }
+            QThread::msleep(50);
+        }
+        qWarning("qicRuntime: Build server %s is not responding.", qPrintable(server_program));
+        stopServer();
+        return false;
+    }
+
+    void stopServer()
+    {
+        {
+            QMutexLocker lock(&server_mutex);
+            server_name.clear();
+        }
+        if (server) {
+            server->kill();
+            server->waitForFinished(1000);
+            delete server;
+            server = nullptr;
+        }
+    }
+
+    // Restarts the build server if it has exited. Called on the runtime's
+    // thread before builds are started.
+    void checkServer()
+    {
+        if (server_program.isEmpty() || (server && server->state() == QProcess::Running)) {
+            return;
+        }
+        if (server) {
+            qWarning("qicRuntime: Build server has exited, restarting.");
+        }
+        if (!startServer()) {
+            // do not retry a server that cannot be started
+            server_program.clear();
+        }
+    }
+
+    // Sends the job to the build server. Returns false if the server could
+    // not be reached or stopped responding, in which case the job must be
+    // built locally. Otherwise, the result of the build is stored in \a ok.
+    bool buildRemote(qicBuildJob &job, const QString &fnlog, bool *ok)
+    {
+        QString name;
+        {
+            QMutexLocker lock(&server_mutex);
+            name = server_name;
+        }
+        // the server cannot link with the libraries of REPL cells
+        if (name.isEmpty() || !job.link.isEmpty()) {
+            return false;
+        }
+
+        QLocalSocket socket;
+        socket.connectToServer(name);
+        if (!socket.waitForConnected(1000)) {
+            qWarning("qicRuntime: Failed to connect to build server, building locally.");
+            return false;
+        }
+
+        QByteArray request;
+        {
+            QDataStream out(&request, QIODevice::WriteOnly);
+            out.setVersion(QDataStream::Qt_5_12);
+            out << qicServerMagic << qicServerVersion << job.src;
+            job.conf.save(out);
+            out << job.lib_path;
+        }
+        qicWriteMessage(&socket, request);
+
+        // wait in small steps, so that the build can be cancelled
+        const qint64 deadline = qicNow() + qicServerResponseTimeout * 1000;
+        QByteArray response;
+        while (!qicReadMessage(&socket, &response)) {
+            if (job.cancelled) {
+                // the server cancels the build when we disconnect
+                socket.abort();
+                *ok = false;
+                return true;
+            }
+            if (job.timedOut()) {
+                // includes the time the job waited in the server's queue
+                qWarning("qicRuntime: Build timed out after %d ms.", job.conf.timeout);
+                socket.abort();
+                *ok = false;
+                return true;
+            }
+            if (socket.state() != QLocalSocket::ConnectedState) {
+                qWarning("qicRuntime: Build server stopped responding, building locally.");
+                return false;
+            }
+            if (qicNow() > deadline) {
+                // disconnecting makes a live server cancel its build
+                qWarning("qicRuntime: Build server did not respond in %lld seconds, building locally.",
+                         qicServerResponseTimeout / 1000);
+                socket.abort();
+                return false;
+            }
+            socket.waitForReadyRead(100);
+        }
+
+        QDataStream in(response);
+        in.setVersion(QDataStream::Qt_5_12);
+        QByteArray log;
+        qint64 queued = 0, elapsed = 0;
+        in >> *ok >> log >> job.deps >> queued >> elapsed;
+        if (in.status() != QDataStream::Ok) {
+            qWarning("qicRuntime: Invalid response from build server, building locally.");
+            return false;
+        }
+
+        QFile flog(job.filePath(fnlog));
+        if (flog.open(QIODevice::WriteOnly | QIODevice::Append)) {
+            flog.write(log);
+        }
+        if (output && !log.isEmpty()) {
+            output(job.id, log);
+        }
+        if (!*ok) {
+            qWarning("qicRuntime: Build failed. See log: %s", qPrintable(job.filePath(fnlog)));
+            return true;
+        }
+        qDebug("qicRuntime: Build server finished in %g seconds, %g seconds in queue.",
+               elapsed / 1000.0, queued / 1000.0);
+        return true;
+    }
+
+    QSharedPointer<qicBuildJob> createJob(const QString &src)
+    {
+        checkServer();
+
+        QSharedPointer<qicBuildJob> job(new qicBuildJob);
+        job->created = qicNow();
+        job->id = next_job++;
+        job->seq = next_seq++;
+        // every build has its own directory, so that builds may run in
+        // parallel without overwriting each other's Makefile
+        if (dir.isValid()) {
+            job->dir = dir.filePath(QString("b%1").arg(job->seq));
+            QDir().mkpath(job->dir);
+        }
+        job->src = src;
+        job->conf = conf;
+        job->conf.tier = conf.tiered && !conf.pgo ? 1 : 0;
+        job->profile = conf.pgo ? 1 : 0;
+        job->lib_path = job->filePath(libName(job->seq));
+        return job;
+    }
+
+    // Creates a job that builds several source files. The object files are
+    // kept in a build directory shared by all builds of the same files and
+    // settings, so that only the changed files need to be compiled.
+    QSharedPointer<qicBuildJob> createProjectJob(const QStringList &files)
+    {
+        QSharedPointer<qicBuildJob> job = createJob(QString());
+        job->sources = files;
+        job->conf.tier = 0;
+        job->profile = 0;
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        hash.addData(job->conf.configKey());
+        hash.addData(QByteArray::number(int(job->conf.build_mode)));
+        hash.addData(job->conf.pch_headers.join(QChar('\n')).toUtf8());
+        hash.addData(files.join(QChar('\n')).toUtf8());
+        if (dir.isValid()) {
+            job->dir = dir.filePath("p" + QString::fromLatin1(hash.result().toHex().left(12)));
+            QDir().mkpath(job->dir);
+        }
+        return job;
+    }
+
+    // Returns the sorted canonical paths of the files, or an empty list if
+    // any of them does not exist.
+    static QStringList canonicalFiles(const QStringList &filenames)
+    {
+        QStringList files;
+        for (const QString &filename : filenames) {
+            const QString fp = QFileInfo(filename).canonicalFilePath();
+            if (fp.isEmpty()) {
+                qWarning("qicRuntime: Failed to open source file: %s", qPrintable(filename));
+                return QStringList();
+            }
+            files << fp;
+        }
+        files.sort();
+        files.removeDuplicates();
+        return files;
+    }
+
+    static QString libName(int seq)
+    {
+        return libName(QString("a%1").arg(seq));
+    }
+
+    // Path of the library built by qmake from project target.
+    static QString libName(const QString &target)
+    {
+#if defined(Q_OS_WIN)
+        QString libn = "bin/%1.dll";
+#elif defined(Q_OS_MACOS)
+        QString libn = "bin/lib%1.dylib";
+#else
+        QString libn = "bin/lib%1.so";
+#endif
+        return libn.arg(target);
+    }
+
+    bool runProcess(const qicBuildJob &job, QString fnlog, QString program, QStringList arguments = QStringList(),
+                    const QByteArray &input = QByteArray())
+    {
+        QFile flog(job.filePath(fnlog));
+        if (!flog.open(QIODevice::WriteOnly | QIODevice::Append)) {
+            qWarning("qicRuntime: Failed to create log file: %s", qPrintable(flog.fileName()));
+        }
+        qicBuildProcess proc;
+        proc.setWorkingDirectory(job.dir);
+        proc.setProcessEnvironment(job.conf.env);
+        proc.setProcessChannelMode(QProcess::MergedChannels);
+        proc.startTool(program, arguments);
+        if (!input.isEmpty()) {
+            proc.write(input);
+        }
+        proc.closeWriteChannel();
+
+        // pass the output on to the log and the buildOutput() signal as it
+        // arrives
+        auto forward = [&]() {
+            const QByteArray data = proc.readAll();
+            if (data.isEmpty()) return;
+            flog.write(data);
+            flog.flush();
+            if (output) {
+                output(job.id, data);
+            }
+        };
+
+        // wait in small steps, so that the build can be cancelled
+        while (!proc.waitForFinished(100) && proc.state() != QProcess::NotRunning) {
+            forward();
+            if (job.cancelled) {
+                proc.stop();
+                return false;
+            }
+            if (job.timedOut()) {
+                proc.stop();
+                forward();
+                const QByteArray msg = QString("qicRuntime: Build timed out after %1 ms.\n")
+                        .arg(job.conf.timeout).toUtf8();
+                flog.write(msg);
+                if (output) {
+                    output(job.id, msg);
+                }
+                qWarning("qicRuntime: Build timed out after %d ms, stopped %s.", job.conf.timeout, qPrintable(program));
+                return false;
+            }
+        }
+        forward();
+        if (proc.error() == QProcess::FailedToStart) {
+            const QByteArray msg = QString("qicRuntime: Failed to start %1: %2\n")
+                    .arg(program, proc.errorString()).toUtf8();
+            flog.write(msg);
+            if (output) {
+                output(job.id, msg);
+            }
+            return false;
+        }
+        return proc.exitStatus() == QProcess::NormalExit &&
+               proc.state()      == QProcess::NotRunning &&
+               proc.exitCode()   == 0;
+    }
+
+    bool writeProject(const qicBuildJob &job, const QString &fnpro, const QString &fncpp, const QStringList &extra = QStringList()) const
+    {
+        QFile fpro(job.filePath(fnpro));
+        if (!fpro.open(QIODevice::WriteOnly)) {
+            return false;
+        }
+        using Qt::endl;
+        const qicBuildConfig &conf = job.conf;
+        QTextStream tpro(&fpro);
+        tpro << "TEMPLATE = lib" << endl;
+        tpro << "QT = " << conf.qtlibs.join(QChar(' ')) << endl;
+        tpro << "CONFIG += " << conf.qtconf.join(QChar(' ')) << endl;
+#ifdef QT_DEBUG
+        if (conf.autodebug) {
+            tpro << "CONFIG += debug" << endl;
+        }
+#endif
+        tpro << "DESTDIR = bin" << endl;
+        tpro << "SOURCES = " << fncpp << endl;
+        for (const QString &def: conf.defines) {
+            tpro << "DEFINES += " << def << endl;
+        }
+        for (const QString &inc : conf.include_path) {
+            tpro << "INCLUDEPATH += " << inc << endl;
+        }
+        for (const QString &lib : conf.libs) {
+            tpro << "LIBS += " << lib << endl;
+        }
+        for (const QString &line : extra) {
+            tpro << line << endl;
+        }
+        return true;
+    }
+
+    // Obtains the compiler and linker flags for the build configuration by
+    // generating a Makefile for an empty probe project. The result is cached
+    // per configuration, and in the cache directory if one is set. Must be
+    // called with probe_mutex locked.
+    qicToolchain probe(const qicBuildJob &job, const QByteArray &config_key)
+    {
+        auto it = toolchains.constFind(config_key);
+        if (it != toolchains.constEnd()) {
+            return *it;
+        }
+        if (probe_failed.contains(config_key)) {
+            return qicToolchain();
+        }
+
+        qicToolchain tc;
+        bool generated = false;
+        // .flags files of earlier versions hold paths into deleted probe
+        // directories
+        QString fnflags = QString::fromLatin1(config_key) + ".flags2";
+        if (disk.isOpen()) {
+            tc = qicToolchain::load(disk.filePath(fnflags));
+        }
+
+        if (!tc.isValid()) {
+            QString name = "probe-" + QString::fromLatin1(config_key.left(12));
+            QString fncpp = name + ".cpp";
+            QString fnpro = name + ".pro";
+            QString fnmk = name + ".mk";
+            QString fnlog = name + ".log";
+
+            QFile fcpp(job.filePath(fncpp));
+            if (fcpp.open(QIODevice::WriteOnly)) {
+                fcpp.close();
+                // single configuration Makefile with all variables inline
+                if (writeProject(job, fnpro, fncpp, { "CONFIG -= debug_and_release debug_and_release_target" }) &&
+                    runProcess(job, fnlog, job.conf.qmake, { fnpro, "-o", fnmk })) {
+                    generated = true;
+                    tc = qicToolchain::fromMakefile(job.filePath(fnmk));
+                }
+            }
+            if (tc.isValid() && disk.isOpen()) {
+                tc.save(disk.filePath(fnflags));
+            }
+        }
+
+        if (tc.isValid()) {
+            return *toolchains.insert(config_key, tc);
+        }
+        // a Makefile without usable flags stays that way, while a qmake run
+        // that failed, timed out or was cancelled is retried by the next build
+        if (generated) {
+            probe_failed.insert(config_key);
+        }
+        return tc;
+    }
+
+    // Builds the precompiled header of the build configuration, if it does
+    // not exist yet. Returns path to the header that should be force-included
+    // by the compiled source, or empty string if there is none. The header is
+    // stored in the cache directory, if one is set, so it is reused by later
+    // runs of the host program. Must be called with probe_mutex locked.
+    QString precompiledHeader(const qicBuildJob &job, const qicToolchain &tc, const QByteArray &config_key)
+    {
+        if (job.conf.pch_headers.isEmpty() || !tc.isValid() || tc.msvc) {
+            return QString();
+        }
+
+        // The key covers the configuration, the header list and modification
+        // times of headers found in the include path.
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        hash.addData(config_key);
+        const QStringList inc = tc.includeDirs();
+        QStringList lines;
+        for (QString header : job.conf.pch_headers) {
+            if (!header.startsWith(QChar('<')) && !header.startsWith(QChar('"'))) {
+                header = QChar('<') + header + QChar('>');
+            }
+            lines << "#include " + header;
+            hash.addData(header.toUtf8());
+            for (const QString &d : inc) {
+                QFileInfo fi(QDir(job.dir).absoluteFilePath(d) + QChar('/') + header.mid(1, header.size() - 2));
+                if (fi.exists()) {
+                    hash.addData(QByteArray::number(fi.lastModified().toMSecsSinceEpoch()));
+                    break;
+                }
+            }
+        }
+        const QByteArray key = hash.result().toHex();
+        if (pch_failed.contains(key)) {
+            return QString();
+        }
+
+        const QString name = "pch-" + QString::fromLatin1(key.left(16));
+        const QString fph = QDir(disk.isOpen() ? disk.path : job.dir).filePath(name + ".h");
+        const QString fpc = fph + (tc.isClang() ? ".pch" : ".gch");
+        if (QFile::exists(fpc)) {
+            return fph;
+        }
+
+        QSaveFile fh(fph);
+        if (!fh.open(QIODevice::WriteOnly)) {
+            pch_failed.insert(key);
+            return QString();
+        }
+        fh.write(lines.join(QChar('\n')).toUtf8() + '\n');
+        if (!fh.commit()) {
+            pch_failed.insert(key);
+            return QString();
+        }
+
+        // compile under a private name and rename, in case another process is
+        // building the same header
+        QElapsedTimer timer;
+        timer.start();
+        const QString tmp = QString("%1.%2.tmp").arg(fpc).arg(QCoreApplication::applicationPid());
+        const QString fnlog = name + ".log";
+        if (!runProcess(job, fnlog, tc.cxx, tc.cflags + QStringList{ "-x", "c++-header", fph, "-o", tmp })) {
+            qWarning("qicRuntime: Failed to build precompiled header. See log: %s", qPrintable(job.filePath(fnlog)));
+            QFile::remove(tmp);
+            if (!job.cancelled) {
+                pch_failed.insert(key);
+            }
+            return QString();
+        }
+        if (!QFile::rename(tmp, fpc)) {
+            QFile::remove(tmp);
+        }
+        qDebug("qicRuntime: Precompiled header built in %g seconds.", (timer.elapsed() / 1000.0));
+        return fph;
+    }
+
+    // Copies a library previously built from the same source and settings to
+    // the job's library path. Returns false on cache miss.
+    bool fromCache(qicBuildJob &job, const QByteArray &key, bool count_miss = true)
+    {
+        QMutexLocker lock(&mutex);
+
+        CachedBuild entry = cache.value(key);
+        if (entry.lib.isEmpty() && disk.isOpen()) {
+            entry.lib = disk.lookup(key);
+            if (!entry.lib.isEmpty() && !disk.readDeps(key, &entry.deps, &entry.built)) {
+                entry.lib.clear();
+            }
+        }
+        // a header changed since the library was built
+        if (!entry.lib.isEmpty() && depsChanged(entry.deps, entry.built)) {
+            entry.lib.clear();
+            cache.remove(key);
+        }
+        const QString cached = entry.lib;
+#ifdef Q_OS_LINUX
+        if (!cached.isEmpty() && job.conf.in_memory) {
+            // the library is loaded from a memory copy, so it can be used
+            // directly without a fresh copy on disk
+            job.lib_path = cached;
+            job.deps = entry.deps;
+            cache_stats.hits++;
+            qDebug("qicRuntime: Build cache hit, reusing %s.", qPrintable(cached));
+            return true;
+        }
+#endif
+        if (!cached.isEmpty()) {
+            QDir().mkpath(QFileInfo(job.lib_path).path());
+            QFile::remove(job.lib_path);
+            // Load a fresh copy, so the new frame does not share static
+            // data with the library it was built from.
+            if (QFile::copy(cached, job.lib_path)) {
+                job.deps = entry.deps;
+                cache_stats.hits++;
+                qDebug("qicRuntime: Build cache hit, reusing %s.", qPrintable(cached));
+                return true;
+            }
+            cache.remove(key);
+            if (disk.isOpen()) {
+                disk.remove(key);
+            }
+        }
+        if (count_miss) {
+            cache_stats.misses++;
+        }
+        return false;
+    }
+
+    // Stores the built library in the build cache.
+    void toCache(const qicBuildJob &job, const QByteArray &key)
+    {
+        QMutexLocker lock(&mutex);
+
+        CachedBuild entry;
+        entry.lib = job.lib_path;
+        entry.deps = job.deps;
+        entry.built = job.started;
+        cache.insert(key, entry);
+        if (disk.isOpen() && !disk.store(key, job.lib_path, job.deps, job.started)) {
+            qWarning("qicRuntime: Failed to store library in cache directory: %s", qPrintable(disk.path));
+        }
+    }
+
+    // Returns true if any of the headers is missing or has been modified
+    // after the build started.
+    static bool depsChanged(const QStringList &deps, qint64 built)
+    {
+        for (const QString &dep : deps) {
+            QFileInfo fi(dep);
+            if (!fi.exists() || fi.lastModified().toMSecsSinceEpoch() > built) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Reads the headers listed in a make rule written by the compiler's -MMD
+    // option. Paths are relative to the job directory.
+    static QStringList readDepfile(const qicBuildJob &job, const QString &fndep)
+    {
+        QStringList result;
+        QFile f(job.filePath(fndep));
+        if (!f.open(QIODevice::ReadOnly)) {
+            return result;
+        }
+        QByteArray data = f.readAll();
+        data.replace("\\\r\n", " ").replace("\\\n", " ");
+        int i = data.indexOf(": ");
+        if (i < 0) {
+            return result;
+        }
+        QByteArray token;
+        for (i += 2; i <= data.size(); ++i) {
+            const char c = i < data.size() ? data.at(i) : '\n';
+            if (c == '\\' && i + 1 < data.size() && data.at(i + 1) == ' ') {
+                token += ' ';
+                ++i;
+            } else if (c == '$' && i + 1 < data.size() && data.at(i + 1) == '$') {
+                token += '$';
+                ++i;
+            } else if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+                if (!token.isEmpty()) {
+                    result << QDir(job.dir).absoluteFilePath(QString::fromLocal8Bit(token));
+                    token.clear();
+                }
+                if (c == '\n') break;
+            } else {
+                token += c;
+            }
+        }
+        return result;
+    }
+
+    // Reads the headers listed by the MSVC /showIncludes option.
+    static QStringList readShowIncludes(const qicBuildJob &job, const QString &fnlog)
+    {
+        QStringList result;
+        QFile f(job.filePath(fnlog));
+        if (!f.open(QIODevice::ReadOnly)) {
+            return result;
+        }
+        const QByteArray note("Note: including file:");
+        while (!f.atEnd()) {
+            const QByteArray line = f.readLine();
+            const int i = line.indexOf(note);
+            if (i >= 0) {
+                result << QDir(job.dir).absoluteFilePath(QString::fromLocal8Bit(line.mid(i + note.size()).trimmed()));
+            }
+        }
+        return result;
+    }
+
+    // Collects the headers included by the job's source, except generated
+    // files such as the precompiled header.
+    static void collectDeps(qicBuildJob &job, bool msvc, const QString &fndep, const QString &fnlog, const QString &pch)
+    {
+        setDeps(job, msvc ? readShowIncludes(job, fnlog) : readDepfile(job, fndep), pch);
+    }
+
+    static void setDeps(qicBuildJob &job, const QStringList &deps, const QString &pch)
+    {
+        const QString jobdir = QFileInfo(job.dir).canonicalFilePath() + QChar('/');
+        const QString pchdir = pch.isEmpty() ? QString() : QFileInfo(pch).canonicalPath() + QChar('/');
+        QSet<QString> seen;
+        job.deps.clear();
+        for (const QString &dep : deps) {
+            const QString fp = QFileInfo(dep).canonicalFilePath();
+            if (fp.isEmpty() || fp.startsWith(jobdir) || (!pchdir.isEmpty() && fp.startsWith(pchdir))) continue;
+            if (seen.contains(fp)) continue;
+            seen.insert(fp);
+            job.deps << fp;
+        }
+    }
+
+    // Builds the job's source code into a shared library. This may be called
+    // from a worker thread.
+    bool build(qicBuildJob &job)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        job.deadline = job.conf.timeout > 0 ? qicNow() + qint64(job.conf.timeout) * 1000 : 0;
+
+        if (job.dir.isEmpty()) {
+            qWarning("qicRuntime: Failed to create temp directory.");
+            return false;
+        }
+
+        if (!job.sources.isEmpty()) {
+            return buildProject(job, timer);
+        }
+
+        if (job.profile != 0) {
+            return buildProfiled(job, timer);
+        }
+
+        const qicBuildConfig &conf = job.conf;
+        const int seq = job.seq;
+        job.started = QDateTime::currentMSecsSinceEpoch();
+        job.deps.clear();
+
+        // a tiered build needs no fast build once the optimized one is cached
+
+        if (conf.cache && conf.tier == 1) {
+            qicBuildConfig optimized = conf;
+            optimized.tier = 0;
+            qicPhaseTimer phase(job, "cache");
+            if (fromCache(job, optimized.buildKey(job.src), false)) {
+                job.conf.tier = 0;
+                job.cache_hit = true;
+                return true;
+            }
+        }
+
+        // reuse a library previously built from the same source and settings
+
+        QByteArray key;
+        if (conf.cache) {
+            key = conf.buildKey(job.src);
+            qicPhaseTimer phase(job, "cache");
+            if (fromCache(job, key)) {
+                job.cache_hit = true;
+                return true;
+            }
+        }
+
+        // build on the build server if one is running
+
+        bool remote_ok = false;
+        bool remote = false;
+        {
+            qicPhaseTimer phase(job, "server");
+            remote = buildRemote(job, QString("a%1.log").arg(seq), &remote_ok);
+        }
+        if (remote) {
+            job.remote = true;
+            return remote_ok && finishBuild(job, key, timer);
+        }
+
+        QString fncpp = QString("a%1.cpp").arg(seq);
+        QString fnlog = QString("a%1.log").arg(seq);
+        QString fndep = QString("a%1.d").arg(seq);
+
+        const QByteArray config_key = conf.configKey();
+        qicToolchain tc;
+        QString pch;
+        if (conf.build_mode == qicRuntime::DirectBuild || !conf.pch_headers.isEmpty()) {
+            qicPhaseTimer phase(job, "probe");
+            QMutexLocker lock(&probe_mutex);
+            tc = probe(job, config_key);
+            // the header is precompiled with the optimization flags of the
+            // regular build, which clang refuses to use in an -O0 build
+            if (conf.tier != 1) {
+                pch = precompiledHeader(job, tc, config_key);
+            }
+        }
+
+        // build directly with the compiler using flags probed from qmake
+
+        if (conf.build_mode == qicRuntime::DirectBuild) {
+            if (tc.isValid()) {
+                QStringList extra;
+                if (!pch.isEmpty()) {
+                    extra << "-include" << pch;
+                }
+                // the last optimization flag wins
+                if (conf.tier == 1) {
+                    extra << (tc.msvc ? "/Od" : "-O0");
+                }
+                // list the included headers
+                if (tc.msvc) {
+                    extra << "/showIncludes";
+                } else {
+                    extra << "-MMD" << "-MF" << fndep;
+                }
+                // pass the source on stdin instead of writing it to a file
+                QByteArray input;
+                if (conf.in_memory && !tc.msvc) {
+                    fncpp = "-";
+                    input = job.src.toUtf8();
+                } else if (!writeSource(job, fncpp)) {
+                    return false;
+                }
+                qicPhaseTimer phase(job, "compile");
+                if (!runProcess(job, fnlog, tc.cxx, tc.buildArgs(fncpp, job.lib_path, extra, job.link), input)) {
+                    qWarning("qicRuntime: Build failed. See log: %s", qPrintable(job.filePath(fnlog)));
+                    return false;
+                }
+                collectDeps(job, tc.msvc, fndep, fnlog, pch);
+                return finishBuild(job, key, timer);
+            }
+            qWarning("qicRuntime: Failed to probe compiler flags, falling back to qmake build.");
+        }
+
+        // build using qmake and make
+
+        QString fnpro = QString("a%1.pro").arg(seq);
+        QStringList extra;
+        if (!pch.isEmpty()) {
+            extra << "QMAKE_CXXFLAGS += -include " + pch;
+        }
+        if (conf.tier == 1) {
+            extra << "QMAKE_CXXFLAGS_RELEASE -= $$QMAKE_CFLAGS_OPTIMIZE $$QMAKE_CFLAGS_OPTIMIZE_FULL";
+        }
+        for (const QString &lib : job.link) {
+            extra << "LIBS += \"" + lib + "\"";
+        }
+#ifdef Q_CC_MSVC
+        const bool msvc = true;
+        extra << "QMAKE_CXXFLAGS += /showIncludes";
+#else
+        const bool msvc = false;
+        extra << "QMAKE_CXXFLAGS += -MMD -MF " + fndep;
+#endif
+        if (!writeSource(job, fncpp)) {
+            return false;
+        }
+        if (!writeProject(job, fnpro, fncpp, extra)) {
+            qWarning("qicRuntime: Failed to create temp project file.");
+            return false;
+        }
+
+//        for (QString k : conf.env.keys()) {
+//            QString v = conf.env.value(k);
+//            qDebug("[env]   %s=%s", qPrintable(k), qPrintable(v));
+//        }
+
+        bool qmake_ok;
+        {
+            qicPhaseTimer phase(job, "qmake");
+            qmake_ok = runProcess(job, fnlog, conf.qmake, { fnpro });
+        }
+        if (!qmake_ok) {
+            qWarning("qicRuntime: Failed to generate Makefile. See log: %s", qPrintable(job.filePath(fnlog)));
+            return false;
+        }
+
+        bool make_ok;
+        {
+            qicPhaseTimer phase(job, "compile");
+            make_ok = runProcess(job, fnlog, conf.make);
+        }
+        if (!make_ok) {
+            qWarning("qicRuntime: Build failed. See log: %s", qPrintable(job.filePath(fnlog)));
+            return false;
+        }
+
+        collectDeps(job, msvc, fndep, fnlog, pch);
+        return finishBuild(job, key, timer);
+    }
+
+    bool writeSource(const qicBuildJob &job, const QString &fncpp)
+    {
+        QFile fcpp(job.filePath(fncpp));
+        if (!fcpp.open(QIODevice::WriteOnly)) {
+            qWarning("qicRuntime: Failed to create temp source file.");
+            return false;
+        }
+        {
+            QTextStream tcpp(&fcpp);
+            tcpp << job.src;
+        }
+        fcpp.close();
+        return true;
+    }
+
+    // Builds the job's source for profile-guided optimization, either
+    // instrumented or using the profile collected by the instrumented build.
+    // Both builds compile the same source file to the same object file in
+    // the directory of the instrumented build, where the compiler looks for
+    // the profile. Supported with gcc and clang in DirectBuild mode, other
+    // builds fall back to a regular build.
+    bool buildProfiled(qicBuildJob &job, const QElapsedTimer &timer)
+    {
+        const qicBuildConfig &conf = job.conf;
+        job.started = QDateTime::currentMSecsSinceEpoch();
+        job.deps.clear();
+
+        qicToolchain tc;
+        if (conf.build_mode == qicRuntime::DirectBuild) {
+            qicPhaseTimer phase(job, "probe");
+            QMutexLocker lock(&probe_mutex);
+            tc = probe(job, conf.configKey());
+        }
+        QString profdata;
+        if (tc.isValid() && tc.isClang()) {
+            profdata = QStandardPaths::findExecutable("llvm-profdata", { QFileInfo(tc.cxx).absolutePath() });
+            if (profdata.isEmpty()) {
+                profdata = QStandardPaths::findExecutable("llvm-profdata");
+            }
+        }
+        if (!tc.isValid() || tc.msvc || (tc.isClang() && profdata.isEmpty())) {
+            if (job.profile == 1) {
+                qWarning("qicRuntime: Profile-guided builds need gcc or clang and llvm-profdata in DirectBuild mode, "
+                         "building without profile.");
+            }
+            job.profile = 0;
+            return build(job);
+        }
+
+        const QString fncpp = job.filePath("pgo.cpp");
+        const QString fnobj = job.filePath("pgo.o");
+        const QString fnraw = job.filePath("pgo-raw");
+        const QString fnprof = job.filePath("pgo.profdata");
+        const QString fnlog = QString("pgo%1.log").arg(job.seq);
+
+        // the hook that writes the profile is only compiled into the
+        // instrumented build, the code of both builds is otherwise the same
+        QFile fcpp(fncpp);
+        if (!fcpp.open(QIODevice::WriteOnly)) {
+            qWarning("qicRuntime: Failed to create temp source file.");
+            return false;
+        }
+        fcpp.write(job.src.toUtf8());
+        fcpp.write("\n#ifdef QIC_PROFILE_GENERATE\n"
+                   "#ifdef __clang__\n"
+                   "extern \"C\" int __llvm_profile_write_file(void);\n"
+                   "extern \"C\" __attribute__((visibility(\"default\"))) void qic_profile_dump() { __llvm_profile_write_file(); }\n"
+                   "#else\n"
+                   "extern \"C\" void __gcov_dump(void);\n"
+                   "extern \"C\" __attribute__((visibility(\"default\"))) void qic_profile_dump() { __gcov_dump(); }\n"
+                   "#endif\n"
+                   "#endif\n");
+        fcpp.close();
+
+        QStringList flags;
+        if (job.profile == 1) {
+            flags << "-DQIC_PROFILE_GENERATE";
+            flags << (tc.isClang() ? "-fprofile-generate=" + fnraw : QString("-fprofile-generate"));
+        } else {
+            if (tc.isClang()) {
+                qicPhaseTimer phase(job, "profile");
+                const QStringList raw = QDir(fnraw).entryList({ "*.profraw" }, QDir::Files);
+                QStringList args = { "merge", "-o", fnprof };
+                for (const QString &fn : raw) {
+                    args << QDir(fnraw).filePath(fn);
+                }
+                if (raw.isEmpty() || !runProcess(job, fnlog, profdata, args)) {
+                    qWarning("qicRuntime: Failed to merge the profile. See log: %s", qPrintable(job.filePath(fnlog)));
+                    return false;
+                }
+                flags << "-fprofile-use=" + fnprof;
+            } else {
+                flags << "-fprofile-use" << "-fprofile-correction" << "-Wno-missing-profile";
+            }
+        }
+
+        {
+            qicPhaseTimer phase(job, "compile");
+            if (!runProcess(job, fnlog, tc.cxx, tc.compileArgs(fncpp, fnobj, flags + QStringList{ "-MMD", "-MF", "pgo.d" }))) {
+                qWarning("qicRuntime: Build failed. See log: %s", qPrintable(job.filePath(fnlog)));
+                return false;
+            }
+        }
+        {
+            qicPhaseTimer phase(job, "link");
+            QStringList args = tc.linkArgs({ fnobj }, job.lib_path);
+            if (job.profile == 1) {
+                // links the profiling runtime
+                args << "-fprofile-generate";
+            }
+            QDir().mkpath(QFileInfo(job.lib_path).path());
+            if (!runProcess(job, fnlog, tc.cxx, args)) {
+                qWarning("qicRuntime: Build failed. See log: %s", qPrintable(job.filePath(fnlog)));
+                return false;
+            }
+        }
+        collectDeps(job, false, "pgo.d", fnlog, QString());
+
+        qDebug("qicRuntime: %s build finished in %g seconds.", job.profile == 1 ? "Instrumented" : "Profile-guided",
+               (timer.elapsed() / 1000.0));
+        return true;
+    }
+
+    // Builds the job's source files into a shared library. Object files that
+    // are newer than their source file and headers are reused.
+    bool buildProject(qicBuildJob &job, const QElapsedTimer &timer)
+    {
+        QMutexLocker project_lock(&project_mutex);
+
+        const qicBuildConfig &conf = job.conf;
+        job.started = QDateTime::currentMSecsSinceEpoch();
+        job.deps.clear();
+
+        const QString fnlog = "project.log";
+        const QString fnlib = libName(QString("project"));
+        QDir().mkpath(job.filePath("obj"));
+        QDir().mkpath(job.filePath("bin"));
+
+        const QByteArray config_key = conf.configKey();
+        qicToolchain tc;
+        QString pch;
+        if (conf.build_mode == qicRuntime::DirectBuild || !conf.pch_headers.isEmpty()) {
+            qicPhaseTimer phase(job, "probe");
+            QMutexLocker lock(&probe_mutex);
+            tc = probe(job, config_key);
+            pch = precompiledHeader(job, tc, config_key);
+        }
+
+        if (conf.build_mode == qicRuntime::DirectBuild && tc.isValid()) {
+            // compile changed translation units one by one
+            QStringList objects;
+            QStringList deps;
+            bool relink = !QFileInfo::exists(job.filePath(fnlib));
+            const QDateTime linked = QFileInfo(job.filePath(fnlib)).lastModified();
+            for (const QString &src : job.sources) {
+                const QString name = "obj/" + QFileInfo(src).completeBaseName() + "-" + QString::fromLatin1(
+                        QCryptographicHash::hash(src.toUtf8(), QCryptographicHash::Sha1).toHex().left(8));
+                const QString fnobj = name + (tc.msvc ? ".obj" : ".o");
+                const QString fndep = name + ".d";
+                const QString fnobjlog = name + ".log";
+
+                QStringList objdeps = tc.msvc ? readShowIncludes(job, fnobjlog) : readDepfile(job, fndep);
+                if (isOutdated(job.filePath(fnobj), QStringList(src) + objdeps)) {
+                    QStringList extra;
+                    if (!pch.isEmpty()) {
+                        extra << "-include" << pch;
+                    }
+                    if (tc.msvc) {
+                        extra << "/showIncludes";
+                    } else {
+                        extra << "-MMD" << "-MF" << fndep;
+                    }
+                    QFile::remove(job.filePath(fnobjlog));
+                    qicPhaseTimer phase(job, "compile");
+                    if (!runProcess(job, fnobjlog, tc.cxx, tc.compileArgs(src, fnobj, extra))) {
+                        QFile::remove(job.filePath(fnobj));
+                        qWarning("qicRuntime: Build failed. See log: %s", qPrintable(job.filePath(fnobjlog)));
+                        return false;
+                    }
+                    objdeps = tc.msvc ? readShowIncludes(job, fnobjlog) : readDepfile(job, fndep);
+                    relink = true;
+                } else if (QFileInfo(job.filePath(fnobj)).lastModified() > linked) {
+                    relink = true;
+                }
+                objects << fnobj;
+                deps << objdeps;
+            }
+
+            if (relink) {
+                qicPhaseTimer phase(job, "link");
+                if (!runProcess(job, fnlog, tc.cxx, tc.linkArgs(objects, fnlib))) {
+                    qWarning("qicRuntime: Build failed. See log: %s", qPrintable(job.filePath(fnlog)));
+                    return false;
+                }
+            }
+            setDeps(job, deps, pch);
+        } else {
+            if (conf.build_mode == qicRuntime::DirectBuild) {
+                qWarning("qicRuntime: Failed to probe compiler flags, falling back to qmake build.");
+            }
+
+            // make rebuilds only the objects that are out of date
+            if (!QFileInfo::exists(job.filePath("Makefile"))) {
+                QStringList sources;
+                for (const QString &src : job.sources) {
+                    sources << QChar('"') + src + QChar('"');
+                }
+                QStringList extra;
+                extra << "OBJECTS_DIR = obj";
+                if (!pch.isEmpty()) {
+                    extra << "QMAKE_CXXFLAGS += -include " + pch;
+                }
+#ifdef Q_CC_MSVC
+                extra << "QMAKE_CXXFLAGS += /showIncludes";
+#else
+                extra << "QMAKE_CXXFLAGS += -MMD";
+#endif
+                if (!writeProject(job, "project.pro", sources.join(QChar(' ')), extra)) {
+                    qWarning("qicRuntime: Failed to create temp project file.");
+                    return false;
+                }
+                qicPhaseTimer phase(job, "qmake");
+                if (!runProcess(job, fnlog, conf.qmake, { "project.pro" })) {
+                    QFile::remove(job.filePath("Makefile"));
+                    qWarning("qicRuntime: Failed to generate Makefile. See log: %s", qPrintable(job.filePath(fnlog)));
+                    return false;
+                }
+            }
+
+            bool make_ok;
+            {
+                qicPhaseTimer phase(job, "compile");
+                make_ok = runProcess(job, fnlog, conf.make);
+            }
+            if (!make_ok) {
+                qWarning("qicRuntime: Build failed. See log: %s", qPrintable(job.filePath(fnlog)));
+                return false;
+            }
+
+#ifdef Q_CC_MSVC
+            // the log accumulates the headers of all builds of the project
+            setDeps(job, readShowIncludes(job, fnlog), pch);
+#else
+            QStringList deps;
+            for (const QString &fndep : QDir(job.filePath("obj")).entryList({ "*.d" }, QDir::Files)) {
+                deps << readDepfile(job, "obj/" + fndep);
+            }
+            setDeps(job, deps, pch);
+#endif
+        }
+
+        // load a fresh copy, the project library is overwritten by the next
+        // build
+        QDir().mkpath(QFileInfo(job.lib_path).path());
+        QFile::remove(job.lib_path);
+        if (!QFile::copy(job.filePath(fnlib), job.lib_path)) {
+            qWarning("qicRuntime: Failed to copy library %s.", qPrintable(job.filePath(fnlib)));
+            return false;
+        }
+
+        qDebug("qicRuntime: Build finished in %g seconds.", (timer.elapsed() / 1000.0));
+        return true;
+    }
+
+    // Returns true if the file is missing or older than any of its inputs.
+    static bool isOutdated(const QString &path, const QStringList &inputs)
+    {
+        QFileInfo fi(path);
+        if (!fi.exists()) {
+            return true;
+        }
+        const QDateTime modified = fi.lastModified();
+        for (const QString &input : inputs) {
+            QFileInfo in(input);
+            if (!in.exists() || in.lastModified() > modified) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool finishBuild(const qicBuildJob &job, const QByteArray &key, const QElapsedTimer &timer)
+    {
+        if (job.conf.cache) {
+            toCache(job, key);
+        }
+
+        qDebug("qicRuntime: Build finished in %g seconds.", (timer.elapsed() / 1000.0));
+        return true;
+    }
+
+    // Loads the built library, resolves the entry point and executes it in a
+    // new context frame.
+    bool execLibrary(qicBuildJob &job, bool execute = true, qicScript *script = nullptr)
+    {
+        // load library
+
+        int memfd = -1;
+        QString map_name;
+        QLibrary *lib;
+        {
+            qicPhaseTimer phase(job, "load");
+            lib = loadLibrary(job, &memfd, &map_name);
+        }
+        if (!lib) {
+            return false;
+        }
+
+        // resolve entry points
+
+        qic_entry_f qic_exports, qic_entry;
+        qic_save_f qic_save;
+        qic_load_f qic_load;
+        {
+            qicPhaseTimer phase(job, "resolve");
+            qic_exports = (qic_entry_f) lib->resolve("qic_exports");
+            qic_entry = (qic_entry_f) lib->resolve("qic_entry");
+            qic_save = (qic_save_f) lib->resolve("qic_save");
+            qic_load = (qic_load_f) lib->resolve("qic_load");
+        }
+        if (!qic_entry && !qic_exports) {
+            qWarning("qicRuntime: Failed to resolve qic_entry: %s", qPrintable(lib->errorString()));
+            lib->unload();
+            delete lib;
+#ifdef Q_OS_LINUX
+            if (memfd >= 0) ::close(memfd);
+#endif
+            return false;
+        }
+
+        // add frame record
+
+        ctx.pushFrame(lib);
+        qicFrame &frame = ctx.frames.back();
+        frame.memfd = memfd;
+        frame.map_name = map_name;
+        frame.entry_fn = qic_entry;
+        frame.exports_fn = qic_exports;
+        frame.save_fn = qic_save;
+        frame.load_fn = qic_load;
+        frame.origin = job.watch;
+        if (script) {
+            frame.pinned = true;
+            *script = frame.id;
+        }
+
+        // take over the state of the previous version of the code
+
+        if (qic_load) {
+            qicPhaseTimer phase(job, "handoff");
+            handOver(frame);
+        }
+
+        // execute
+
+        if (execute) {
+            qicPhaseTimer phase(job, "entry");
+            runFrame(frame);
+        }
+
+        collectFrames();
+
+        return true;
+    }
+
+    // Loads the library of the job, from a memory file if the job was
+    // configured for in-memory builds. Returns null if the library could not
+    // be loaded.
+    QLibrary *loadLibrary(const qicBuildJob &job, int *memfd, QString *map_name)
+    {
+        const QString &lib_path = job.lib_path;
+        QString load_path = lib_path;
+        if (job.conf.in_memory) {
+            *memfd = memoryFile(lib_path, map_name);
+            if (*memfd >= 0) {
+                load_path = QString("/proc/self/fd/%1").arg(*memfd);
+            }
+        }
+        QLibrary *lib = new QLibrary(load_path);
+        if (!lib->load()) {
+            qWarning("qicRuntime: Failed to load library %s: %s", qPrintable(lib_path), qPrintable(lib->errorString()));
+            delete lib;
+#ifdef Q_OS_LINUX
+            if (*memfd >= 0) ::close(*memfd);
+#endif
+            *memfd = -1;
+            return nullptr;
+        }
+        return lib;
+    }
+
+    // Copies the library into an anonymous memory file, so that every load
+    // maps a fresh copy without writing one to disk. The descriptor must stay
+    // open while the library is loaded, so that its /proc path is not reused.
+    // Returns -1 where memory files are not supported.
+    static int memoryFile(const QString &lib_path, QString *map_name)
+    {
+#if defined(Q_OS_LINUX) && defined(MFD_CLOEXEC)
+        QFile f(lib_path);
+        if (!f.open(QIODevice::ReadOnly)) {
+            return -1;
+        }
+        // every memory file has its own name, so that the mappings of two
+        // frames loaded from the same cached library are told apart
+        static std::atomic<int> next_file { 1 };
+        const QByteArray name = QFileInfo(lib_path).fileName().toLocal8Bit() + '.' +
+                                QByteArray::number(next_file++);
+        const int fd = ::memfd_create(name.constData(), MFD_CLOEXEC);
+        if (fd < 0) {
+            return -1;
+        }
+        QFile mem;
+        if (!mem.open(fd, QIODevice::WriteOnly, QFileDevice::DontCloseHandle) ||
+                mem.write(f.readAll()) != f.size() || !mem.flush()) {
+            ::close(fd);
+            return -1;
+        }
+        *map_name = "/memfd:" + QString::fromLocal8Bit(name) + " (deleted)";
+        return fd;
+#else
+        Q_UNUSED(lib_path)
+        Q_UNUSED(map_name)
+        return -1;
+#endif
+    }
+
+    // Passes the state saved by the qic_save() of the most recent older frame
+    // built from the same file to the frame's qic_load(). The state is null
+    // if the code is not from a watched file, or that frame does not save its
+    // state, has already saved it or has been unloaded.
+    void handOver(qicFrame &frame)
+    {
+        void *state = nullptr;
+        for (auto it = ctx.frames.rbegin(); it != ctx.frames.rend() && !frame.origin.isEmpty(); ++it) {
+            if (&*it == &frame || it->origin != frame.origin) continue;
+            if (it->save_fn && !it->saved) {
+                it->saved = true;
+                ctx.activate(&*it);
+                state = it->save_fn(&ctx);
+            }
+            break;
+        }
+        ctx.activate(&frame);
+        frame.load_fn(&ctx, state);
+        ctx.activate(nullptr);
+    }
+
+    // Calls the frame's entry points. Variables and functions registered by
+    // the code are added to this frame, even if newer frames exist.
+    void runFrame(qicFrame &frame)
+    {
+        ctx.activate(&frame);
+        if (frame.exports_fn && !frame.exported) {
+            frame.exported = true;
+            frame.exports_fn(&ctx);
+        }
+        if (frame.entry_fn) {
+            const qint64 start = qicNow();
+            frame.entry_fn(&ctx);
+            frame.runs++;
+            frame.run_time += qicNow() - start;
+        }
+        ctx.activate(nullptr);
+    }
+
+    // Loads and executes a built job, then records its statistics and emits
+    // execStats().
+    bool loadJob(qicRuntime *q, qicBuildJob &job, bool execute = true, qicScript *script = nullptr)
+    {
+        const bool ok = job.ok && !job.cancelled && execLibrary(job, execute, script);
+        if (ok && job.conf.tier == 1) {
+            startUpgrade(q, createUpgradeJob(ctx.frames.back().id, job));
+        } else if (ok && job.profile == 1) {
+            startProfile(q, createUpgradeJob(ctx.frames.back().id, job));
+        }
+
+        qicExecStats stats;
+        stats.job = job.id;
+        stats.ok = ok;
+        stats.cache_hit = job.cache_hit;
+        stats.remote = job.remote;
+        stats.total = qicNow() - job.created;
+        for (const qicPhase &phase : job.phases) {
+            const QByteArray name(phase.name);
+            qint64 *field = name == "cache"   ? &stats.cache :
+                            name == "server"  ? &stats.server :
+                            name == "probe"   ? &stats.probe :
+                            name == "qmake"   ? &stats.qmake :
+                            name == "compile" ? &stats.compile :
+                            name == "link"    ? &stats.link :
+                            name == "load"    ? &stats.load :
+                            name == "resolve" ? &stats.resolve :
+                            name == "handoff" ? &stats.handoff :
+                            name == "entry"   ? &stats.entry : nullptr;
+            if (field) {
+                *field += phase.duration;
+            }
+        }
+        last_stats = stats;
+
+        // keep the phases for the session trace, dropping the oldest quarter
+        // of the events when full
+        const size_t events = job.phases.size() + 1;
+        if (trace.size() + events > qicTraceLimit) {
+            trace.erase(trace.begin(), trace.begin() + std::min(trace.size(), qicTraceLimit / 4 + events));
+        }
+        trace.push_back({ "exec", job.created, stats.total, quintptr(QThread::currentThreadId()), job.id });
+        for (const qicPhase &phase : job.phases) {
+            trace.push_back({ phase.name, phase.start, phase.duration, phase.thread, job.id });
+        }
+
+        emit q->execStats(stats);
+        return ok;
+    }
+
+    // Builds a REPL cell against the headers and libraries of the earlier
+    // cells, then loads and executes it.
+    bool execCell(qicRuntime *q, const QString &declarations, const QString &statements)
+    {
+        // popFrame() may have unloaded the most recent cells
+        cells.erase(std::remove_if(cells.begin(), cells.end(), [this](const qicCell &cell) {
+            return !ctx.findFrame(cell.frame);
+        }), cells.end());
+
+        QString header, definitions;
+        qicSplitCell(declarations, &header, &definitions);
+
+        QString src = qicCellPrelude;
+        for (const qicCell &cell : cells) {
+            src += "#include \"" + cell.header + "\"\n";
+        }
+        src += definitions;
+        src += "\nextern \"C\" QIC_ENTRY_EXPORT void qic_entry(qicContext *ctx) {\n"
+               "(void) ctx;\n" + statements + "\n}\n";
+
+        // the library must stay where the later cells link with it
+        QSharedPointer<qicBuildJob> job = createJob(src);
+        job->conf.cache = false;
+        job->conf.tier = 0;
+        job->profile = 0;
+        for (const qicCell &cell : cells) {
+            job->link << cell.link;
+        }
+        job->ok = build(*job);
+
+        qicScript script = 0;
+        if (!loadJob(q, *job, true, &script)) {
+            return false;
+        }
+
+        // a cell that failed leaves no trace in the later cells
+        qicCell cell;
+        cell.frame = script;
+        cell.header = dir.filePath(QString("cell%1.h").arg(job->seq));
+        QFile fh(cell.header);
+        if (!fh.open(QIODevice::WriteOnly)) {
+            qWarning("qicRuntime: Failed to create cell header.");
+            return false;
+        }
+        fh.write("#pragma once\n");
+        fh.write(header.toUtf8());
+        fh.close();
+#ifdef Q_OS_WIN
+        const QFileInfo fi(job->lib_path);
+        cell.link = fi.dir().filePath(fi.completeBaseName() + ".lib");
+#else
+        cell.link = job->lib_path;
+#endif
+        cells.push_back(cell);
+        return true;
+    }
+
+    // Creates the job that builds the code of a tier 1 or instrumented build
+    // again, optimized or with the collected profile, to be swapped into its
+    // frame.
+    QSharedPointer<qicBuildJob> createUpgradeJob(quint64 frame, const qicBuildJob &fast)
+    {
+        QSharedPointer<qicBuildJob> job = createJob(fast.src);
+        job->conf = fast.conf;
+        job->conf.tier = 0;
+        job->watch = fast.watch;
+        job->upgrade_frame = frame;
+        job->profile = fast.profile == 1 ? 2 : 0;
+        if (job->profile == 2) {
+            // built next to the instrumented build, where the profile is
+            job->dir = fast.dir;
+            job->lib_path = job->filePath(libName(job->seq));
+        }
+        return job;
+    }
+
+    // Builds the upgrade job in the background, then swaps it into the frame.
+    void startUpgrade(qicRuntime *q, QSharedPointer<qicBuildJob> job)
+    {
+        // the code of an older version of the same file is being replaced
+        for (const QSharedPointer<qicBuildJob> &other : upgrades) {
+            if (!job->watch.isEmpty() && other->watch == job->watch) {
+                other->cancelled = true;
+            }
+        }
+        upgrades.insert(job->id, job);
+
+        upgrade_pool.start(new qicBuildTask([this, q, job]() {
+            if (!job->cancelled) {
+                job->ok = build(*job);
+            }
+            QMetaObject::invokeMethod(q, [this, job]() {
+                upgrades.remove(job->id);
+                if (job->ok && !job->cancelled) {
+                    upgradeFrame(*job);
+                }
+            }, Qt::QueuedConnection);
+        }));
+    }
+
+    // Collects the profile of an instrumented build until the profiling time
+    // has passed or the code has been run often enough, then starts the
+    // build that uses the profile.
+    void startProfile(qicRuntime *q, QSharedPointer<qicBuildJob> job)
+    {
+        const quint64 frame = job->upgrade_frame;
+        profiling.insert(frame, job);
+        if (job->conf.pgo_msec > 0) {
+            QTimer::singleShot(job->conf.pgo_msec, q, [this, q, frame]() {
+                finishProfile(q, frame);
+            });
+        }
+    }
+
+    // Finishes profiling when the frame has been run often enough.
+    void checkProfile(qicRuntime *q, const qicFrame &frame)
+    {
+        auto it = profiling.constFind(frame.id);
+        if (it != profiling.constEnd() && (*it)->conf.pgo_runs > 0 && frame.runs >= (*it)->conf.pgo_runs) {
+            finishProfile(q, frame.id);
+        }
+    }
+
+    // Writes the profile collected by the frame's instrumented library and
+    // starts the build that uses it.
+    void finishProfile(qicRuntime *q, quint64 id)
+    {
+        QSharedPointer<qicBuildJob> job = profiling.take(id);
+        qicFrame *frame = ctx.findFrame(id);
+        if (!job || !frame || frame->saved || frame->retired) {
+            // unloaded, retired or replaced by a newer version meanwhile
+            return;
+        }
+        typedef void (*qic_profile_dump_f)();
+        const qic_profile_dump_f dump = (qic_profile_dump_f) frame->lib->resolve("qic_profile_dump");
+        if (!dump) {
+            qWarning("qicRuntime: Failed to write the profile of frame %llu.", (unsigned long long) id);
+            return;
+        }
+        dump();
+        startUpgrade(q, job);
+    }
+
+    // Swaps the optimized build into the frame of the tier 1 or instrumented
+    // build. The frame keeps the replaced library loaded, as objects created
+    // by its code may still be alive. The new qic_exports() replaces the
+    // exported functions and run() calls the new qic_entry() from now on.
+    // The state of the replaced code is handed over with qic_save() and
+    // qic_load(), as on a reload.
+    void upgradeFrame(qicBuildJob &job)
+    {
+        qicFrame *frame = ctx.findFrame(job.upgrade_frame);
+        if (!frame || frame->fast_lib || frame->saved || frame->retired) {
+            // unloaded, retired or replaced by a newer version meanwhile
+            return;
+        }
+
+        int memfd = -1;
+        QString map_name;
+        QLibrary *lib = loadLibrary(job, &memfd, &map_name);
+        if (!lib) {
+            return;
+        }
+        const qic_entry_f qic_exports = (qic_entry_f) lib->resolve("qic_exports");
+        const qic_entry_f qic_entry = (qic_entry_f) lib->resolve("qic_entry");
+        const qic_save_f qic_save = (qic_save_f) lib->resolve("qic_save");
+        const qic_load_f qic_load = (qic_load_f) lib->resolve("qic_load");
+
+        void *state = nullptr;
+        if (qic_load && frame->save_fn) {
+            ctx.activate(frame);
+            state = frame->save_fn(&ctx);
+        }
+
+        frame->runs_before = frame->runs;
+        frame->run_time_before = frame->run_time;
+        frame->runs = 0;
+        frame->run_time = 0;
+        frame->profiled = job.profile == 2;
+        frame->fast_lib = frame->lib;
+        frame->fast_memfd = frame->memfd;
+        frame->lib = lib;
+        frame->memfd = memfd;
+        frame->map_name = map_name;
+        frame->entry_fn = qic_entry;
+        frame->exports_fn = qic_exports;
+        frame->save_fn = qic_save;
+        frame->load_fn = qic_load;
+
+        ctx.activate(frame);
+        if (qic_load) {
+            qic_load(&ctx, state);
+        }
+        // exports not run yet are run by the first run() of the frame
+        if (qic_exports && frame->exported) {
+            qic_exports(&ctx);
+        }
+        ctx.activate(nullptr);
+
+        qDebug("qicRuntime: Swapped in the %s build of frame %llu.", job.profile == 2 ? "profile-guided" : "optimized",
+               (unsigned long long) job.upgrade_frame);
+    }
+
+    // Builds the job on the worker thread, then loads and executes it on the
+    // runtime's thread and emits execFinished().
+    int startAsync(qicRuntime *q, QSharedPointer<qicBuildJob> job)
+    {
+        jobs.insert(job->id, job);
+
+        pool.start(new qicBuildTask([this, q, job]() {
+            // build on the worker thread
+            if (!job->cancelled) {
+                job->ok = build(*job);
+            }
+
+            // load and execute on the runtime's thread
+            QMetaObject::invokeMethod(q, [this, q, job]() {
+                jobs.remove(job->id);
+                if (job->ok && !job->watch.isEmpty()) {
+                    setWatchDeps(job->watch, job->sources + job->deps);
+                }
+                bool ok = loadJob(q, *job);
+                emit q->execFinished(job->id, ok);
+            }, Qt::QueuedConnection);
+        }));
+
+        return job->id;
+    }
+
+    // Replaces the headers of a watched file and updates the index of
+    // files that depend on each header.
+    void setWatchDeps(const QString &path, const QStringList &deps)
+    {
+        Watch &w = watches[path];
+        for (const QString &dep : w.deps) {
+            auto it = dependents.find(dep);
+            if (it == dependents.end()) continue;
+            it->remove(path);
+            if (it->isEmpty()) {
+                dependents.erase(it);
+                if (!watches.contains(dep)) {
+                    watcher->removePath(dep);
+                }
+                unwatchDir(dep);
+            }
+        }
+        w.deps = deps;
+        for (const QString &dep : deps) {
+            QSet<QString> &files = dependents[dep];
+            if (files.isEmpty()) {
+                watcher->addPath(dep);
+                watchDir(dep);
+            }
+            files.insert(path);
+        }
+    }
+
+    // Watches the directory of a watched file or header, so that a file
+    // replaced by an editor is picked up again. Directories are counted by
+    // the files in them and unwatched with the last one.
+    void watchDir(const QString &file)
+    {
+        const QString dir = QFileInfo(file).absolutePath();
+        if (watched_dirs[dir]++ == 0) {
+            watcher->addPath(dir);
+        }
+    }
+
+    void unwatchDir(const QString &file)
+    {
+        auto it = watched_dirs.find(QFileInfo(file).absolutePath());
+        if (it != watched_dirs.end() && --*it == 0) {
+            watcher->removePath(it.key());
+            watched_dirs.erase(it);
+        }
+    }
+
+    // Schedules a rebuild of the watched file, or of all watched files that
+    // include the header.
+    void fileChanged(const QString &path)
+    {
+        auto it = watches.find(path);
+        if (it != watches.end()) {
+            it->timer->start();
+        }
+        auto dit = dependents.constFind(path);
+        if (dit != dependents.constEnd()) {
+            for (const QString &file : *dit) {
+                Watch &w = watches[file];
+                w.dep_changed = true;
+                w.timer->start();
+            }
+        }
+    }
+
+    void startWatcher(qicRuntime *q)
+    {
+        if (watcher) {
+            return;
+        }
+        watcher = new QFileSystemWatcher(q);
+        QObject::connect(watcher, &QFileSystemWatcher::fileChanged, q, [this](const QString &path){
+            // Some editors save files by deleting and replacing them, which
+            // makes QFileSystemWatcher stop watching the file. Such files are
+            // picked up again when their directory changes.
+            if (QFileInfo::exists(path)) {
+                watcher->addPath(path);
+            }
+            fileChanged(path);
+        });
+        QObject::connect(watcher, &QFileSystemWatcher::directoryChanged, q, [this](const QString &path){
+            const QStringList watched = watcher->files();
+            const QSet<QString> files(watched.cbegin(), watched.cend());
+            QStringList replaced;
+            for (auto it = watches.constBegin(); it != watches.constEnd(); ++it) {
+                if (!files.contains(it.key()) && QFileInfo(it.key()).absolutePath() == path) {
+                    replaced << it.key();
+                }
+            }
+            for (auto it = dependents.constBegin(); it != dependents.constEnd(); ++it) {
+                if (!files.contains(it.key()) && QFileInfo(it.key()).absolutePath() == path) {
+                    replaced << it.key();
+                }
+            }
+            for (const QString &file : replaced) {
+                if (QFileInfo::exists(file)) {
+                    watcher->addPath(file);
+                    fileChanged(file);
+                }
+            }
+        });
+    }
+
+    // Returns the watch of a file or project, creating its debounce timer.
+    Watch &watch(qicRuntime *q, const QString &key)
+    {
+        Watch &w = watches[key];
+        if (!w.timer) {
+            w.timer = new QTimer(q);
+            w.timer->setSingleShot(true);
+            w.timer->setInterval(watch_delay);
+            QObject::connect(w.timer, &QTimer::timeout, q, [this, q, key](){
+                rebuildWatch(q, key);
+            });
+            QObject::connect(q, &qicRuntime::execFinished, w.timer, [this, key](int job, bool ok){
+                Watch &w = watches[key];
+                if (w.job == job) {
+                    // a version that failed is built again on the next save
+                    if (ok) {
+                        w.hash = w.job_hash;
+                    }
+                    w.job = 0;
+                }
+            });
+        }
+        return w;
+    }
+
+    // Starts a background build of a watched file or project that changed.
+    void rebuildWatch(qicRuntime *q, const QString &key)
+    {
+        Watch &w = watches[key];
+        QSharedPointer<qicBuildJob> job;
+        if (w.project.isEmpty()) {
+            QFile f(key);
+            if (!f.open(QIODevice::ReadOnly)) {
+                // replaced file not written yet, wait for the next change
+                return;
+            }
+            const QByteArray data = f.readAll();
+            const QByteArray hash = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+
+            // skip saves that did not change the file or its headers
+            if (!w.dep_changed && (w.job != 0 ? hash == w.job_hash : hash == w.hash)) return;
+            w.job_hash = hash;
+            job = createJob(QString::fromUtf8(data));
+        } else {
+            if (!w.dep_changed) return;
+            job = createProjectJob(w.project);
+        }
+        w.dep_changed = false;
+
+        // a newer save makes a pending build of this file out of date
+        if (w.job != 0) {
+            q->cancel(w.job);
+        }
+        job->watch = key;
+        w.job = startAsync(q, job);
+    }
+
+    // Unloads frames according to the unload policy. Frames that exported
+    // functions are retired once all of their functions and variables have
+    // been replaced by newer code. Frames with calls in flight are kept
+    // until a later collection. The global frame and the most recent frame
+    // are always kept.
+    void collectFrames()
+    {
+        QMutexLocker lock(&ctx.mutex);
+        std::vector<qicFrame> &frames = ctx.frames;
+        for (size_t i = frames.size(); i-- > 1; ) {
+            const qicFrame &frame = frames[i];
+            // retired frames, e.g. by popFrame(), go once their calls return
+            if (frame.retired) {
+                ctx.tryRemoveFrame(i);
+                continue;
+            }
+            if (frame.pinned || i == frames.size() - 1) {
+                continue;
+            }
+            if ((drop_idle || !frame.exports.empty()) && ctx.isIdle(frame)) {
+                ctx.tryRemoveFrame(i);
+            }
+        }
+        if (max_frames > 0) {
+            size_t i = 1;
+            while (frames.size() - 1 > size_t(max_frames) && i < frames.size() - 1) {
+                if (frames[i].pinned || !ctx.tryRemoveFrame(i)) {
+                    ++i;
+                }
+            }
+        }
+    }
+
+    // Returns the number of bytes mapped from each library file.
+    static QHash<QString, qint64> mappedBytes()
     {
-        char buff[1024];
-        va_list args;
-        va_start(args, fmt);
-        vsnprintf(buff, 1024, fmt, args);
-        va_end(args);
-        qDebug("%s", buff);
+        QHash<QString, qint64> mapped;
+#ifdef Q_OS_LINUX
+        // /proc reports size 0, so read until there is no more data
+        QFile f("/proc/self/maps");
+        if (f.open(QIODevice::ReadOnly)) {
+            while (true) {
+                const QByteArray line = f.readLine();
+                if (line.isEmpty()) break;
+                // address perms offset dev inode path
+                const QList<QByteArray> fields = line.simplified().split(' ');
+                if (fields.size() < 6) continue;
+                const QList<QByteArray> range = fields[0].split('-');
+                if (range.size() != 2) continue;
+                const qint64 size = range[1].toLongLong(nullptr, 16) - range[0].toLongLong(nullptr, 16);
+                mapped[QString::fromLocal8Bit(fields.mid(5).join(' '))] += size;
+            }
+        }
+#endif
+        return mapped;
     }
 };
 
 
-class qicRuntimePrivate
+
+// Build server. Accepts build jobs from qicRuntime instances in other
+// processes over a local socket and builds them on a thread pool. Probed
+// toolchains, precompiled headers and the build cache are kept in memory
+// between jobs. Quits when idle for 10 minutes.
+class qicBuildServer
 {
 public:
-    QTemporaryDir dir;
-    QProcessEnvironment env;
-    QString qmake, make;
-    // qmake project variables
-    QStringList defines;        // DEFINES
-    QStringList include_path;   // INCLUDEPATH
-    QStringList qtlibs;         // QT
-    QStringList qtconf;         // CONFIG
-    QStringList libs;           // LIBS
-    // additional flags
-    bool autodebug = true;      // add "debug" to CONFIG automatically
-
-    QFileSystemWatcher *watcher = nullptr;
+    qicRuntimePrivate rt;
+    QLocalServer server;
+    QThreadPool pool;
+    QTimer idle;
+    int pending = 0;            // jobs received but not answered yet
 
-    qicContextImpl ctx;
-
-    qicRuntimePrivate()
+    qicBuildServer()
     {
-        env = QProcessEnvironment::systemEnvironment();
-
-        qmake = "qmake"; // assume to be on PATH
-#ifdef Q_OS_WIN
-        make = "nmake";
-#else
-        make = "make";
-#endif
+        idle.setSingleShot(true);
+        idle.setInterval(10 * 60 * 1000);
+        QObject::connect(&idle, &QTimer::timeout, QCoreApplication::instance(), &QCoreApplication::quit);
+        QObject::connect(&server, &QLocalServer::newConnection, [this]() {
+            while (QLocalSocket *socket = server.nextPendingConnection()) {
+                QObject::connect(socket, &QLocalSocket::disconnected, socket, &QObject::deleteLater);
+                QObject::connect(socket, &QLocalSocket::readyRead, socket, [this, socket]() {
+                    QByteArray request;
+                    while (qicReadMessage(socket, &request)) {
+                        handle(socket, request);
+                    }
+                });
+            }
+        });
     }
 
-    bool loadEnv(QString path)
+    ~qicBuildServer()
     {
-        //env.clear();
+        pool.waitForDone();
+    }
 
-        QFile f(path);
-        if (!f.open(QIODevice::ReadOnly)) {
+    bool listen(const QString &name)
+    {
+        QLocalServer::removeServer(name);
+        // clients send the commands and environment of the builds, so only
+        // the user that started the server may connect
+        server.setSocketOptions(QLocalServer::UserAccessOption);
+        if (!server.listen(name)) {
+            qWarning("qicbuildd: Failed to listen on %s: %s", qPrintable(name), qPrintable(server.errorString()));
             return false;
         }
-
-        while (!f.atEnd()) {
-            QString line = f.readLine().trimmed();
-            int eq = line.indexOf(QChar('='));
-            if (eq < 0) continue;
-            QString name = line.mid(0, eq);
-            QString value = line.mid(eq+1);
-            env.insert(name, value);
-        }
-
+        idle.start();
         return true;
     }
 
-    bool runProcess(QString fnlog, QString program, QStringList arguments = QStringList())
+    void handle(QLocalSocket *socket, const QByteArray &request)
     {
-        QString fplog = dir.filePath(fnlog);
-        QProcess proc;
-        proc.setWorkingDirectory(dir.path());
-        proc.setProcessEnvironment(env);
-        proc.setProcessChannelMode(QProcess::MergedChannels);
-        proc.setStandardOutputFile(fplog, QProcess::Append);
-        proc.start(program, arguments);
-        proc.waitForFinished();
-        return proc.exitStatus() == QProcess::NormalExit &&
-               proc.state()      == QProcess::NotRunning &&
-               proc.exitCode()   == 0;
-    }
+        QDataStream in(request);
+        in.setVersion(QDataStream::Qt_5_12);
+        quint32 magic = 0, version = 0;
+        QString src, lib_path;
+        in >> magic >> version;
+        if (magic != qicServerMagic || version != qicServerVersion) {
+            qWarning("qicbuildd: Unsupported request.");
+            socket->abort();
+            return;
+        }
+        in >> src;
+        QSharedPointer<qicBuildJob> job = rt.createJob(src);
+        job->conf.load(in);
+        in >> lib_path;
 
-    QString getLibPath() const
-    {
-#ifdef Q_OS_WIN
-        QString libn = "bin/a%1.dll";
-#else
-        QString libn = "bin/a%1";
-#endif
-        return dir.filePath(libn.arg(seq()));
-    }
+        // the client disconnects to cancel the build
+        QObject::connect(socket, &QLocalSocket::disconnected, [job]() { job->cancelled = true; });
 
-    int seq() const
-    {
-        return (int)ctx.frames.size();
+        idle.stop();
+        pending++;
+        QElapsedTimer queued;
+        queued.start();
+        QPointer<QLocalSocket> client(socket);
+        pool.start(new qicBuildTask([this, job, queued, lib_path, client]() {
+            const qint64 wait = queued.elapsed();
+            QElapsedTimer timer;
+            timer.start();
+            job->ok = !job->cancelled && rt.build(*job);
+            if (job->ok) {
+                QDir().mkpath(QFileInfo(lib_path).path());
+                QFile::remove(lib_path);
+                job->ok = QFile::copy(job->lib_path, lib_path);
+            }
+            const qint64 elapsed = timer.elapsed();
+
+            QByteArray log;
+            QFile flog(job->filePath(QString("a%1.log").arg(job->seq)));
+            if (flog.open(QIODevice::ReadOnly)) {
+                log = flog.readAll();
+            }
+            QByteArray response;
+            {
+                QDataStream out(&response, QIODevice::WriteOnly);
+                out.setVersion(QDataStream::Qt_5_12);
+                out << bool(job->ok) << log << job->deps << wait << elapsed;
+            }
+
+            QMetaObject::invokeMethod(&server, [this, client, response]() {
+                if (client) {
+                    qicWriteMessage(client, response);
+                }
+                if (--pending == 0) {
+                    idle.start();
+                }
+            }, Qt::QueuedConnection);
+        }));
     }
 };
 
 
-
 qicRuntime::qicRuntime(QObject *parent) : QObject(parent),
     p(new qicRuntimePrivate)
 {
+    // for queued connections to execStats()
+    qRegisterMetaType<qicExecStats>();
+    p->output = [this](int job, const QByteArray &text) {
+        emit buildOutput(job, QString::fromLocal8Bit(text));
+    };
 }
 
 qicRuntime::~qicRuntime()
@@ -211,48 +3844,96 @@ qicRuntime::~qicRuntime()
 void qicRuntime::setTempDir(QString path)
 {
     p->dir = QTemporaryDir(path);
+    p->dir_set = true;
+}
+
+void qicRuntime::setInMemoryBuilds(bool enable)
+{
+    p->conf.in_memory = enable;
+#ifdef Q_OS_LINUX
+    // keep intermediate files on a RAM-backed file system
+    if (enable && !p->dir_set && QFileInfo("/dev/shm").isWritable()) {
+        p->dir = QTemporaryDir("/dev/shm/qic-XXXXXX");
+    }
+#endif
 }
 
-bool qicRuntime::exec(QString source)
+bool qicRuntime::exec(QString source, qicScript *script)
 {
     // compile
 
-    if (!compile(source)) {
-        return false;
-    }
+    QSharedPointer<qicBuildJob> job = p->createJob(source);
+    job->ok = p->build(*job);
 
-    // load library
+    // load library and execute
 
-    QString lib_path = p->getLibPath();
-    QLibrary *lib = new QLibrary(lib_path);
-    if (!lib->load()) {
-        qWarning("qicRuntime: Failed to load library %s: %s", qPrintable(lib_path), qPrintable(lib->errorString()));
-        delete lib;
-        return false;
-    }
+    return p->loadJob(this, *job, true, script);
+}
+
+qicScript qicRuntime::compileOnly(QString source)
+{
+    QSharedPointer<qicBuildJob> job = p->createJob(source);
+    job->ok = p->build(*job);
+
+    // load library without executing
 
-    // resolve entry point
+    qicScript script = 0;
+    p->loadJob(this, *job, false, &script);
+    return script;
+}
 
-    typedef void (*qic_entry_f)(qicContext *);
-    qic_entry_f qic_entry = (qic_entry_f) lib->resolve("qic_entry");
-    if (!qic_entry) {
-        qWarning("qicRuntime: Failed to resolve qic_entry: %s", qPrintable(lib->errorString()));
-        lib->unload();
-        delete lib;
+bool qicRuntime::run(qicScript script)
+{
+    qicFrame *frame = script ? p->ctx.findFrame(script) : nullptr;
+    if (!frame) {
+        qWarning("qicRuntime: Script %llu is not loaded.", script);
         return false;
     }
+    // frames are collected by exec() and release(), not on this hot path
+    p->runFrame(*frame);
+    p->checkProfile(this, *frame);
+    return true;
+}
 
-    // add frame record
+void qicRuntime::release(qicScript script)
+{
+    qicFrame *frame = script ? p->ctx.findFrame(script) : nullptr;
+    if (frame) {
+        frame->pinned = false;
+        p->collectFrames();
+    }
+}
 
-    qicFrame frame;
-    frame.lib = lib;
-    p->ctx.frames.push_back(frame);
+bool qicRuntime::execCell(QString declarations, QString statements)
+{
+    return p->execCell(this, declarations, statements);
+}
 
-    // execute
+void qicRuntime::clearCells()
+{
+    for (const qicRuntimePrivate::qicCell &cell : p->cells) {
+        release(cell.frame);
+    }
+    p->cells.clear();
+}
 
-    qic_entry(&p->ctx);
+int qicRuntime::execAsync(QString source)
+{
+    return p->startAsync(this, p->createJob(source));
+}
 
-    return true;
+void qicRuntime::cancel(int job)
+{
+    for (const QSharedPointer<qicBuildJob> &j : p->jobs) {
+        if (job == 0 || j->id == job) {
+            j->cancelled = true;
+        }
+    }
+}
+
+bool qicRuntime::isBuilding() const
+{
+    return !p->jobs.isEmpty();
 }
 
 bool qicRuntime::execFile(QString filename)
@@ -266,6 +3947,50 @@ bool qicRuntime::execFile(QString filename)
     return exec(t.readAll());
 }
 
+bool qicRuntime::execBatch(QStringList sources)
+{
+    // build in parallel
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(qMax(1, p->max_parallel));
+    QVector<QSharedPointer<qicBuildJob>> batch;
+    for (const QString &source : sources) {
+        QSharedPointer<qicBuildJob> job = p->createJob(source);
+        batch.append(job);
+        pool.start(new qicBuildTask([this, job]() {
+            job->ok = p->build(*job);
+            job->finished.release();
+        }));
+    }
+
+    // load and execute in order, as soon as each build finishes
+
+    bool ok = true;
+    for (const QSharedPointer<qicBuildJob> &job : batch) {
+        job->finished.acquire();
+        if (!p->loadJob(this, *job)) {
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+bool qicRuntime::execFiles(QStringList filenames)
+{
+    QStringList sources;
+    for (const QString &filename : filenames) {
+        QFile f(filename);
+        if (!f.open(QIODevice::ReadOnly)) {
+            qWarning("qicRuntime: Failed to open source file: %s", qPrintable(filename));
+            return false;
+        }
+        QTextStream t(&f);
+        sources << t.readAll();
+    }
+    return execBatch(sources);
+}
+
 bool qicRuntime::watchExecFile(QString filename, bool execNow)
 {
     QFileInfo file(filename);
@@ -274,66 +3999,136 @@ bool qicRuntime::watchExecFile(QString filename, bool execNow)
     QString absfn = file.canonicalFilePath();
     if (absfn.isEmpty()) return false;
 
-    if (p->watcher == nullptr) {
-        p->watcher = new QFileSystemWatcher(this);
-        QObject::connect(p->watcher, &QFileSystemWatcher::fileChanged, this, [this](const QString &path){
-            // Small workaround, because some editors save files in a "weird" way
-            // that actually deletes and replaces the file and this confuses the
-            // QFileSystemWatcher, which stops watching for subsequent changes.
-            QThread::msleep(250);
-            p->watcher->addPath(path);
+    p->startWatcher(this);
+    const bool watched = p->watches.contains(absfn);
+    if (!watched && !p->watcher->addPath(absfn)) return false;
 
-            execFile(path);
-        });
+    qicRuntimePrivate::Watch &w = p->watch(this, absfn);
+    if (!watched) {
+        p->watchDir(absfn);
+    }
+
+    if (execNow) {
+        QFile f(absfn);
+        if (!f.open(QIODevice::ReadOnly)) {
+            qWarning("qicRuntime: Failed to open source file: %s", qPrintable(absfn));
+            return false;
+        }
+        const QByteArray data = f.readAll();
+
+        QSharedPointer<qicBuildJob> job = p->createJob(QString::fromUtf8(data));
+        job->watch = absfn;
+        job->ok = p->build(*job);
+        if (job->ok) {
+            p->setWatchDeps(absfn, job->deps);
+        }
+        if (!p->loadJob(this, *job)) {
+            return false;
+        }
+        w.hash = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+        return true;
     }
 
-    if (!p->watcher->addPath(absfn)) return false;
+    return true;
+}
+
+bool qicRuntime::execProject(QStringList filenames)
+{
+    const QStringList files = qicRuntimePrivate::canonicalFiles(filenames);
+    if (files.isEmpty()) {
+        return false;
+    }
+
+    QSharedPointer<qicBuildJob> job = p->createProjectJob(files);
+    job->ok = p->build(*job);
+    return p->loadJob(this, *job);
+}
+
+bool qicRuntime::watchExecProject(QStringList filenames, bool execNow)
+{
+    const QStringList files = qicRuntimePrivate::canonicalFiles(filenames);
+    if (files.isEmpty()) {
+        return false;
+    }
+
+    // the project is rebuilt when any of its files or headers changes
+    p->startWatcher(this);
+    const QString key = "project:" + QString::fromLatin1(QCryptographicHash::hash(
+            files.join(QChar('\n')).toUtf8(), QCryptographicHash::Sha1).toHex());
+    p->watch(this, key).project = files;
+    p->setWatchDeps(key, files);
 
     if (execNow) {
-        return execFile(absfn);
+        QSharedPointer<qicBuildJob> job = p->createProjectJob(files);
+        job->watch = key;
+        job->ok = p->build(*job);
+        if (job->ok) {
+            p->setWatchDeps(key, files + job->deps);
+        }
+        return p->loadJob(this, *job);
     }
 
     return true;
 }
 
+void qicRuntime::setWatchDelay(int msec)
+{
+    p->watch_delay = qMax(0, msec);
+    for (const qicRuntimePrivate::Watch &w : p->watches) {
+        w.timer->setInterval(p->watch_delay);
+    }
+}
+
 void qicRuntime::setEnv(QString name, QString value)
 {
-    p->env.insert(name, value);
+    p->conf.env.insert(name, value);
+    p->conf.env_overrides.insert(name);
 }
 
 void qicRuntime::addEnv(QString name, QString value)
 {
-    QString old = p->env.value(name);
+    QString old = p->conf.env.value(name);
     if (!old.isEmpty() && !value.isEmpty()) {
         value.append(QDir::listSeparator());
     }
     value.append(old);
-    p->env.insert(name, value);
+    p->conf.env.insert(name, value);
+    p->conf.env_overrides.insert(name);
 }
 
 bool qicRuntime::loadEnv(QString path)
 {
-    return p->loadEnv(path);
+    return p->conf.loadEnv(path);
 }
 
 void qicRuntime::setQmake(QString path)
 {
-    p->qmake = path;
+    p->conf.qmake = path;
 }
 
 void qicRuntime::setMake(QString path)
 {
-    p->make = path;
+    p->conf.make = path;
+}
+
+void qicRuntime::setBuildMode(BuildMode mode)
+{
+    p->conf.build_mode = mode;
+}
+
+void qicRuntime::setPrecompiledHeaders(QStringList headers)
+{
+    p->conf.pch_headers = headers;
 }
 
 void qicRuntime::setDefines(QStringList defines)
 {
-    p->defines = defines;
+    p->conf.defines = defines;
 }
 
 void qicRuntime::setIncludePath(QStringList dirs)
 {
-    p->include_path = dirs;
+    p->conf.include_path = dirs;
 }
 
 void qicRuntime::setIncludeDirs(QList<QDir> dirs)
@@ -347,105 +4142,216 @@ void qicRuntime::setIncludeDirs(QList<QDir> dirs)
 
 void qicRuntime::setLibs(QStringList libs)
 {
-    p->libs = libs;
+    p->conf.libs = libs;
 }
 
 void qicRuntime::setQtLibs(QStringList qtlibs)
 {
-    p->qtlibs = qtlibs;
+    p->conf.qtlibs = qtlibs;
 }
 
 void qicRuntime::setQtConfig(QStringList qtconf)
 {
-    p->qtconf = qtconf;
+    p->conf.qtconf = qtconf;
 }
 
 void qicRuntime::setAutoDebug(bool enable)
 {
-    p->autodebug = enable;
+    p->conf.autodebug = enable;
 }
 
-void qicRuntime::setUnloadLibs(bool unload)
+void qicRuntime::setMaxParallelBuilds(int count)
 {
-    p->ctx.unloadLibs = unload;
+    p->max_parallel = count > 0 ? count : QThread::idealThreadCount();
 }
 
-qicContext *qicRuntime::ctx()
+void qicRuntime::setTieredBuilds(bool enable)
 {
-    return &p->ctx;
+    p->conf.tiered = enable;
 }
 
-bool qicRuntime::compile(QString src)
+void qicRuntime::setProfileGuidedBuilds(bool enable, int msec, int runs)
 {
-    QElapsedTimer timer;
-    timer.start();
+    p->conf.pgo = enable;
+    p->conf.pgo_runs = qMax(0, runs);
+    // profile for a minute if no limit is given
+    p->conf.pgo_msec = msec > 0 || runs > 0 ? qMax(0, msec) : 60000;
+}
 
-    if (!p->dir.isValid()) {
-        qWarning("qicRuntime: Failed to create temp directory.");
-        return false;
-    }
+void qicRuntime::setBuildTimeout(int msec)
+{
+    p->conf.timeout = qMax(0, msec);
+}
+
+void qicRuntime::setMaxFrames(int count)
+{
+    p->max_frames = qMax(0, count);
+    p->collectFrames();
+}
 
-    const int seq = p->seq();
+void qicRuntime::setDropIdleFrames(bool enable)
+{
+    p->drop_idle = enable;
+    p->collectFrames();
+}
 
-    QString fncpp = QString("a%1.cpp").arg(seq);
-    QFile fcpp(p->dir.filePath(fncpp));
-    if (!fcpp.open(QIODevice::WriteOnly)) {
-        qWarning("qicRuntime: Failed to create temp source file.");
+bool qicRuntime::popFrame()
+{
+    if (p->ctx.frames.size() < 2) {
         return false;
     }
-    {
-        QTextStream tcpp(&fcpp);
-        tcpp << src;
-    }
-    fcpp.close();
+    p->ctx.retireFrame(p->ctx.frames.back());
 
-    QString fnlog = QString("a%1.log").arg(seq);
-    QString fnpro = QString("a%1.pro").arg(seq);
-    QFile fpro(p->dir.filePath(fnpro));
-    if (!fpro.open(QIODevice::WriteOnly)) {
-        qWarning("qicRuntime: Failed to create temp project file.");
+    // Calls that entered the frame's functions before they were unexported
+    // return shortly. They may need the context's lock, so it is not held
+    // while waiting. Frames are only removed on this thread, so the frame
+    // stays at the top of the stack meanwhile.
+    QElapsedTimer timer;
+    timer.start();
+    while (p->ctx.isBusy(p->ctx.frames.back()) && timer.elapsed() < 1000) {
+        QThread::yieldCurrentThread();
+    }
+    if (!p->ctx.tryRemoveFrame(p->ctx.frames.size() - 1)) {
+        qWarning("qicRuntime: Functions of the frame are still executing, it is unloaded once they return.");
         return false;
     }
-    {
-        using Qt::endl;
-        QTextStream tpro(&fpro);
-        tpro << "TEMPLATE = lib" << endl;
-        tpro << "QT = " << p->qtlibs.join(QChar(' ')) << endl;
-        tpro << "CONFIG += " << p->qtconf.join(QChar(' ')) << endl;
-#ifdef QT_DEBUG
-        if (p->autodebug) {
-            tpro << "CONFIG += debug" << endl;
+    return true;
+}
+
+int qicRuntime::frameCount() const
+{
+    return int(p->ctx.frames.size());
+}
+
+QVector<qicFrameStats> qicRuntime::frameStats() const
+{
+    const QHash<QString, qint64> mapped = qicRuntimePrivate::mappedBytes();
+
+    QMutexLocker lock(&p->ctx.mutex);
+    QVector<qicFrameStats> result;
+    for (const qicFrame &frame : p->ctx.frames) {
+        qicFrameStats stats;
+        stats.id = frame.id;
+        stats.vars = int(frame.vars.size());
+        stats.runs = frame.runs_before + frame.runs;
+        stats.run_time = frame.run_time_before + frame.run_time;
+        if (frame.runs_before > 0 && frame.runs > 0 && frame.run_time > 0) {
+            stats.speedup = (double(frame.run_time_before) / frame.runs_before) /
+                            (double(frame.run_time) / frame.runs);
+            stats.profiled = frame.profiled;
         }
+        if (frame.lib) {
+            QFileInfo fi(frame.lib->fileName());
+            stats.library = fi.absoluteFilePath();
+#ifdef Q_OS_LINUX
+            stats.mapped = mapped.value(frame.map_name.isEmpty() ? fi.canonicalFilePath() : frame.map_name);
+#else
+            stats.mapped = fi.size();
 #endif
-        tpro << "DESTDIR = bin" << endl;
-        tpro << "SOURCES = " << fncpp << endl;
-        for (const QString &def: p->defines) {
-            tpro << "DEFINES += " << def << endl;
-        }
-        for (const QString &inc : p->include_path) {
-            tpro << "INCLUDEPATH += " << inc << endl;
-        }
-        for (const QString &lib : p->libs) {
-            tpro << "LIBS += " << lib << endl;
         }
+        result.append(stats);
+    }
+    return result;
+}
+
+bool qicRuntime::setBuildServer(QString program)
+{
+    p->stopServer();
+    p->server_program = program;
+    if (program.isEmpty()) {
+        return true;
+    }
+    if (!p->startServer()) {
+        p->server_program.clear();
+        return false;
+    }
+    return true;
+}
+
+int qicRuntime::runBuildServer(QString name)
+{
+    qicBuildServer server;
+    if (!server.listen(name)) {
+        return 1;
     }
-    fpro.close();
+    return QCoreApplication::exec();
+}
+
+void qicRuntime::setUnloadLibs(bool unload)
+{
+    p->ctx.unloadLibs = unload;
+}
 
-//    for (QString k : p->env.keys()) {
-//        QString v = p->env.value(k);
-//        qDebug("[env]   %s=%s", qPrintable(k), qPrintable(v));
-//    }
+void qicRuntime::setBuildCache(bool enable)
+{
+    p->conf.cache = enable;
+}
 
-    if (!p->runProcess(fnlog, p->qmake, { fnpro })) {
-        qWarning("qicRuntime: Failed to generate Makefile. See log: %s", qPrintable(fnlog));
+bool qicRuntime::setCacheDir(QString path)
+{
+    QMutexLocker lock(&p->mutex);
+    if (path.isEmpty()) {
+        p->disk.close();
+        return true;
+    }
+    if (!p->disk.open(path)) {
+        qWarning("qicRuntime: Failed to open cache directory: %s", qPrintable(path));
         return false;
     }
+    return true;
+}
+
+void qicRuntime::setCacheSize(qint64 bytes)
+{
+    QMutexLocker lock(&p->mutex);
+    p->disk.max_size = bytes;
+}
 
-    if (!p->runProcess(fnlog, p->make)) {
-        qWarning("qicRuntime: Build failed. See log: %s", qPrintable(fnlog));
+void qicRuntime::clearBuildCache()
+{
+    QMutexLocker lock(&p->mutex);
+    p->cache.clear();
+}
+
+qicCacheStats qicRuntime::cacheStats() const
+{
+    QMutexLocker lock(&p->mutex);
+    qicCacheStats stats = p->cache_stats;
+    stats.evictions = p->disk.evictions;
+    return stats;
+}
+
+qicExecStats qicRuntime::lastExecStats() const
+{
+    return p->last_stats;
+}
+
+bool qicRuntime::writeTrace(QString path) const
+{
+    QSaveFile f(path);
+    if (!f.open(QIODevice::WriteOnly)) {
+        qWarning("qicRuntime: Failed to write trace file: %s", qPrintable(path));
         return false;
     }
+    // Chrome trace event format, "X" events are complete events with
+    // timestamps and durations in microseconds
+    const qint64 pid = QCoreApplication::applicationPid();
+    QByteArray json = "{\"traceEvents\":[\n";
+    bool first = true;
+    for (const qicRuntimePrivate::TraceEvent &e : p->trace) {
+        if (!first) json += ",\n";
+        first = false;
+        json += QString("{\"name\":\"%1\",\"cat\":\"qic\",\"ph\":\"X\",\"ts\":%2,\"dur\":%3,"
+                        "\"pid\":%4,\"tid\":%5,\"args\":{\"job\":%6}}")
+                .arg(QLatin1String(e.name)).arg(e.start).arg(e.duration)
+                .arg(pid).arg(quint64(e.thread)).arg(e.job).toUtf8();
+    }
+    json += "\n],\"displayTimeUnit\":\"ms\"}\n";
+    f.write(json);
+    return f.commit();
+}
 
-    qDebug("qicRuntime: Build finished in %g seconds.", (timer.elapsed() / 1000.0));
-    return true;
+qicContext *qicRuntime::ctx()
+{
+    return &p->ctx;
 }
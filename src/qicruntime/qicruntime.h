@@ -22,8 +22,11 @@ SOFTWARE. */
 #define QICRUNTIME_H
 
 #include <QDir>
+#include <QMetaType>
+#include <QObject>
 #include <QString>
 #include <QStringList>
+#include <QVector>
 
 #ifdef QIC_STATIC
 #       define QIC_EXPORT
@@ -41,6 +44,88 @@ struct qicContext;
 
 class QIODevice;
 
+/**
+    \struct qicCacheStats
+    Build cache counters returned by qicRuntime::cacheStats(). Every build
+    with the cache enabled counts as either a hit or a miss. Evictions count
+    libraries removed from the cache directory by this process.
+ */
+struct qicCacheStats
+{
+    int hits = 0;
+    int misses = 0;
+    int evictions = 0;
+};
+
+/**
+    \typedef qicScript
+    Handle to a loaded piece of runtime-compiled code, returned by
+    qicRuntime::exec() and qicRuntime::compileOnly() and passed to
+    qicRuntime::run(). 0 is not a valid handle.
+ */
+typedef quint64 qicScript;
+
+/**
+    \struct qicFrameStats
+    Describes one context frame, see qicRuntime::frameStats(). The first
+    frame holds the variables registered by the host program and has no
+    library. \a mapped is the number of bytes of the library mapped into
+    the process. Outside of Linux, this is the size of the library file.
+    For frames whose code was replaced by an optimized build, see
+    qicRuntime::setTieredBuilds() and qicRuntime::setProfileGuidedBuilds(),
+    \a speedup is the average time of qic_entry() before the swap divided by
+    the average time after it, or 0 if qic_entry() has not run on both sides.
+    The code before the swap is the unoptimized build of a tiered build, or
+    the instrumented build of a profile-guided build, in which case
+    \a profiled is `true`. The instrumented build is slower than a regular
+    optimized build, so this speedup overstates the gain of the profile
+    over the regular build.
+ */
+struct qicFrameStats
+{
+    quint64 id = 0;
+    QString library;
+    int vars = 0;
+    qint64 mapped = 0;
+    int runs = 0;               // qic_entry() calls
+    qint64 run_time = 0;        // in qic_entry(), microseconds
+    double speedup = 0;
+    bool profiled = false;      // speedup is over the instrumented build
+};
+
+/**
+    \struct qicExecStats
+    Timing of one build and execution, see qicRuntime::execStats(). All
+    times are in microseconds. \a total runs from the call that started
+    the build to the return of qic_entry() and includes the time a
+    background build spent waiting in the queue. Phases that did not run
+    are 0. In `QmakeBuild` mode, \a compile covers `make`, which compiles
+    and links. A single source built in `DirectBuild` mode is compiled and
+    linked by one compiler command, which \a compile covers as well, so
+    \a link is 0. \a link is only measured separately for projects
+    built in `DirectBuild` mode and for profile-guided builds.
+ */
+struct qicExecStats
+{
+    int job = 0;
+    bool ok = false;
+    bool cache_hit = false;
+    bool remote = false;        // built by the build server
+    qint64 total = 0;
+    qint64 cache = 0;           // build cache lookup
+    qint64 server = 0;          // build on the build server
+    qint64 probe = 0;           // compiler flags and precompiled header
+    qint64 qmake = 0;
+    qint64 compile = 0;
+    qint64 link = 0;
+    qint64 load = 0;            // QLibrary::load()
+    qint64 resolve = 0;         // resolving the entry points
+    qint64 handoff = 0;         // qic_save() of the previous version and qic_load()
+    qint64 entry = 0;           // qic_exports() and qic_entry()
+};
+
+Q_DECLARE_METATYPE(qicExecStats)
+
 /**
     \class qicRuntime
     The qicRuntime class provides the runtime build and execution environment.
@@ -76,16 +161,148 @@ class QIODevice;
     intermediate files and log files. The directory is automatically deleted in
     the destructor. The default temporary directory location is system specific.
 
+    \fn qicRuntime::setInMemoryBuilds()
+    Keeps the build off the disk as much as the platform allows. On Linux,
+    the temporary directory is moved to `/dev/shm`, unless set by
+    setTempDir(), and libraries are loaded from anonymous memory files, so
+    build cache hits are loaded without copying the library on disk. In
+    `DirectBuild` mode with gcc or clang, the source code is passed to the
+    compiler on stdin. Call this before the first build.
+
     \fn qicRuntime::exec()
     Compiles and executes the provided C++ code. This method is blocking and
     returns only after the build process completes and the qic_entry() function
     returns.
 
+    If \a script is not null, it receives a handle to the loaded code, which
+    can be executed again with run(). The library is then kept loaded until
+    release() is called, regardless of the frame unload policy.
+
+    \fn qicRuntime::compileOnly()
+    Compiles and loads the provided C++ code, but does not execute it.
+    Returns a handle to be passed to run(), or 0 if the build or load
+    failed. Use this to build code ahead of time, e.g. at startup, and run
+    it later without waiting for the compiler. Call release() when the
+    handle is no longer needed.
+
+    \fn qicRuntime::run()
+    Calls the qic_entry() function of previously loaded code again, at the
+    cost of a function call. On the first run of code loaded by
+    compileOnly(), qic_exports() is called first. Variables registered by
+    the code belong to the same frame as the code and replace the values
+    set by earlier runs, which are destroyed with the frame. The frame unload policy is applied by exec() and
+    release(), not by run(). Returns `false` if \a script is not loaded,
+    e.g. after popFrame().
+
+    \fn qicRuntime::release()
+    Releases the handle returned by exec() or compileOnly(). The code stays
+    loaded until the frame unload policy, popFrame() or the destructor
+    unloads it.
+
     \fn qicRuntime::execFile()
     Same as exec() except the source code is read from the \a filename.
 
+    \fn qicRuntime::execBatch()
+    Compiles and executes several pieces of C++ code. The code is built in
+    parallel, using up to setMaxParallelBuilds() concurrent builds. Each
+    piece of code is then executed in the order given, as soon as it and all
+    pieces before it have been built. Code that fails to build is skipped.
+    Returns `true` if all pieces were built and executed. This method is
+    blocking.
+
+    \fn qicRuntime::execFiles()
+    Same as execBatch() except the source code is read from \a filenames.
+
+    \fn qicRuntime::execCell()
+    Compiles and executes a cell of a REPL session. \a declarations are
+    placed at namespace scope and \a statements in the body of qic_entry(),
+    which the cell defines. The functions, variables and types declared by
+    a cell are visible to the cells executed after it: each cell is built
+    with a generated header that declares them and is linked with the
+    libraries of the earlier cells, so a cell compiles only its own code.
+
+    Functions and variables are exported from the cell's library. Types,
+    templates, inline and `const` entities are copied into the header, and
+    `static` ones stay private to the cell. Variables must be declared with
+    their type, not `auto`, and initialized with `=` or braces. Member
+    functions should be defined in their class. Cells stay loaded until
+    clearCells() or the destructor, unless popFrame() unloads them. The
+    include directives of a cell are copied into the header as well.
+
+    \fn qicRuntime::clearCells()
+    Starts a new REPL session, in which cells no longer see the
+    declarations of the earlier cells. The libraries of the earlier cells
+    are released, like with release(), so that the frame unload policy can
+    unload them.
+
+    \fn qicRuntime::execAsync()
+    Same as exec() except this method returns immediately. The code is built
+    on a worker thread, then the library is loaded and the qic_entry()
+    function is called on the thread of the qicRuntime object, and finally
+    the execFinished() signal is emitted. Builds started by consecutive calls
+    run one after another and are executed in the same order. Returns the
+    job id passed to execFinished().
+
+    \fn qicRuntime::cancel()
+    Cancels the background build \a job started by execAsync(), or all
+    background builds if \a job is 0. A running compiler is killed. The
+    code of a cancelled build is not executed and execFinished() reports a
+    failure.
+
+    \fn qicRuntime::isBuilding()
+    Returns `true` while a background build started by execAsync() has not
+    finished yet.
+
+    \fn qicRuntime::execFinished()
+    This signal is emitted when the background build \a job started by
+    execAsync() finishes. \a ok is `true` if the code was built and
+    executed.
+
+    \fn qicRuntime::buildOutput()
+    This signal is emitted while \a job is being built, whenever the compiler
+    or build tool writes to its output, e.g. diagnostics. \a text is a
+    chunk of the output, not necessarily complete lines. The output is also
+    written to the build's log file. For builds on a worker thread, the
+    signal is emitted from that thread. Output of builds on the build server
+    is emitted when the build finishes.
+
     \fn qicRuntime::watchExecFile()
-    Watches a file and calls execFile() each time the file is changed.
+    Watches a file and executes it each time the file is changed. Bursts of
+    changes, e.g. several quick saves, are merged into one build, see
+    setWatchDelay(). The file is built in the background with execAsync(),
+    so the event loop keeps running. A change made while the previous
+    version is still building cancels that build. Files that the editor
+    saves by deleting and replacing them stay watched. A save that does not
+    change the file is skipped, unless the last build of the file failed.
+    If \a execNow is `true`, the file is also built and executed right away,
+    blocking until qic_entry() returns, and the result is returned.
+    Otherwise returns `true` once the file is watched.
+
+    Each new version of the file can take over the state of the previous one
+    through the qic_save() and qic_load() hooks, e.g. objects released with
+    qicContext::take() or data kept in qicContext::blob(), instead of
+    rebuilding it.
+
+    The headers included by the file, as reported by the compiler, are
+    watched as well. When a header changes, only the watched files that
+    include it are rebuilt. Headers in system include directories are not
+    watched, except with MSVC.
+
+    \fn qicRuntime::execProject()
+    Compiles several source files into one library and executes it. The
+    files together must define qic_entry() or qic_exports(). The object
+    files are kept in a build directory shared by all builds of the same set
+    of files, so that a later build only compiles the files that changed,
+    directly or through one of their headers, and links the library again.
+    Project builds bypass the build cache.
+
+    \fn qicRuntime::watchExecProject()
+    Same as watchExecFile() for a set of files built with execProject(). A
+    change to any of the files or their headers rebuilds the project.
+
+    \fn qicRuntime::setWatchDelay()
+    Sets how long watchExecFile() waits after the last change of a file
+    before building it. Defaults to 100 ms.
 
     \fn qicRuntime::setEnv()
     Sets an environment variable for the build process.
@@ -105,6 +322,23 @@ class QIODevice;
     \fn qicRuntime::setMake()
     Sets the path to the `make` utility, or `nmake` on Windows.
 
+    \fn qicRuntime::setBuildMode()
+    Selects how the runtime-compiled code is built. In the default
+    `QmakeBuild` mode, a `qmake` project is generated for every build and
+    built using `qmake` and `make`. In the `DirectBuild` mode, the compiler
+    and linker flags are obtained from `qmake` once per build configuration
+    and the code is then built with a single compiler invocation, which
+    saves two process launches per build. If the flags cannot be obtained,
+    the `qmake` build is used instead.
+
+    \fn qicRuntime::setPrecompiledHeaders()
+    Sets the list of headers to precompile, e.g. `{ "QPainter", "qicentry.h" }`.
+    The headers are precompiled once per build configuration and the
+    precompiled header is then force-included by every build. It is rebuilt
+    automatically when the build configuration changes, e.g. the include path,
+    defines or **CONFIG**, or when one of the listed headers is modified.
+    Supported with GCC and Clang toolchains. Pass an empty list to disable.
+
     \fn qicRuntime::setDefines()
     Sets the content of the **DEFINES** `qmake` variable.
 
@@ -136,6 +370,112 @@ class QIODevice;
     qic Runtime was compiled in debug mode, i.e. `QT_DEBUG` macro was defined.
     This is enabled by default.
 
+    \fn qicRuntime::setMaxParallelBuilds()
+    Sets the maximum number of builds that execBatch() runs concurrently.
+    Pass 0 to use the number of CPU cores, which is the default.
+
+    \fn qicRuntime::setTieredBuilds()
+    Enables tiered builds, which trade the speed of the first version of the
+    code for a shorter wait. The code is first built without optimization,
+    which takes considerably less time, then loaded and executed as usual.
+    The same code is then built again in the background with the configured
+    settings and swapped in when ready: its qic_exports() replaces the
+    exported functions and run() calls its qic_entry(), but qic_entry() is
+    not executed on the swap. Variables and objects registered by the first
+    build stay valid, as its library is unloaded only with the frame.
+    Static variables of the optimized code start out fresh; hand state kept
+    in them over with qic_save() and qic_load(), which are called on the
+    swap as on a reload. If the optimized build is in the build cache, it is
+    used right away. The unoptimized build does not use the precompiled
+    header of setPrecompiledHeaders(), which is built with the optimization
+    flags of the regular build. Projects are not tiered. Useful when the
+    configured build is optimized, i.e. not in `debug` configuration.
+    Disabled by default.
+
+    \fn qicRuntime::setProfileGuidedBuilds()
+    Enables profile-guided optimization for code that runs for a long time,
+    typically loaded with compileOnly() and called with run() or through
+    exported functions. The code is first built with instrumentation,
+    loaded and used as usual while it collects a profile, for \a msec
+    milliseconds or until it has been run() \a runs times, whichever comes
+    first. Pass 0 to not limit either. The code is then built again with the
+    profile in the background and swapped in like the optimized build of
+    setTieredBuilds(). frameStats() reports the speedup of qic_entry() over
+    the instrumented build, which is somewhat slower than a regular
+    optimized build, not over a regular optimized build. Requires gcc, or clang with `llvm-profdata`, in `DirectBuild`
+    mode; other builds are built regularly. Profiled builds bypass the build
+    cache and the build server, and take precedence over tiered builds.
+    Disabled by default.
+
+    \fn qicRuntime::setBuildTimeout()
+    Sets the time in milliseconds one build may take, including all processes
+    it starts. A build that exceeds it is stopped: the running build tool and
+    every process it has started, e.g. the compilers run by `make`, are asked
+    to terminate and killed if they do not exit within 2 seconds, and the
+    build fails. Pass 0 to let builds run without limit. The default is
+    5 minutes.
+
+    \fn qicRuntime::setMaxFrames()
+    Every successful exec() adds a context frame that holds the loaded library
+    and the variables registered by its code. Frames are kept until the
+    runtime is destroyed by default. This limits the number of frames kept
+    besides the global frame. When exceeded, the oldest frames are unloaded:
+    their variables are destroyed and their libraries unloaded. Pass 0 to
+    keep all frames.
+
+    \fn qicRuntime::setDropIdleFrames()
+    If enabled, frames whose variables are all shadowed by newer frames, or
+    that registered no variables at all, are unloaded after each exec(). The
+    most recent frame is always kept. Only enable this if the
+    runtime-compiled code leaves no other references to its code or data
+    behind, e.g. connected lambdas or objects owned by the host.
+
+    \fn qicRuntime::popFrame()
+    Unloads the most recent frame. Variables it has shadowed become visible
+    again. Functions exported by the frame are unexported first, then calls
+    that are still executing them are given a second to return. If they do
+    not, the frame is unloaded by a later collection once they have
+    returned. Returns `false` if there is no frame to unload or the frame
+    could not be unloaded yet.
+
+    \fn qicRuntime::frameCount()
+    Returns the number of context frames, including the global frame.
+
+    \fn qicRuntime::frameStats()
+    Returns the memory and mapping statistics of all context frames, oldest
+    first.
+
+    \fn qicRuntime::setBuildServer()
+    Starts the build server \a program, usually the `qicbuildd` utility, and
+    sends subsequent builds to it over a local socket. The server is a
+    small, long-lived process that keeps probed toolchains, precompiled
+    headers and its build cache in memory, and starts the compiler from a
+    small process instead of the host, which is cheaper for large hosts.
+    If the server exits, it is restarted before the next build. A build the
+    server cannot take, or does not answer within two minutes, is built
+    locally. Pass an empty string to stop the
+    server. Returns `false` if the server could not be started.
+
+    \fn qicRuntime::runBuildServer()
+    Runs the build server under the local socket \a name until it is idle
+    for 10 minutes. This is the main function of `qicbuildd`. Requires a
+    QCoreApplication instance. Returns the exit code.
+
+    \fn qicRuntime::execStats()
+    Emitted after every build and execution started by exec(), execAsync(),
+    execBatch(), execProject(), compileOnly() or a watched file, whether
+    it succeeded or not.
+
+    \fn qicRuntime::lastExecStats()
+    Returns the timing of the last build and execution.
+
+    \fn qicRuntime::writeTrace()
+    Writes the timing of the builds and executions of this runtime to
+    \a path in the Chrome trace event format, which can be opened in
+    `chrome://tracing` or Perfetto. Only the last 100000 or so timing
+    events are kept, so the trace of a long session leaves out the oldest
+    builds.
+
     \fn qicRuntime::setUnloadLibs()
     If set to `true`, dynamically loaded libs will be unloaded in the
     destructor. Otherwise, libs that contain runtime-compiled code will remain
@@ -145,25 +485,81 @@ class QIODevice;
     runtime-compiled code outlive the qicRuntime.
     This is initially set to `true`.
 
+    \fn qicRuntime::setBuildCache()
+    Enables or disables the build cache. The cache is keyed on a hash of the
+    source code, the build settings including the build mode, the `qmake`
+    and `make` paths and the build related environment variables. When exec() is called with a source
+    that has already been built with the same settings, the build is skipped
+    and a copy of the previously built library is loaded instead. Headers
+    included by the source are not part of the key. This is enabled by
+    default.
+
+    \fn qicRuntime::setCacheDir()
+    Sets a persistent cache directory. Built libraries are stored in this
+    directory and reused by later runs of the host program, so that scripts
+    do not have to be rebuilt after a restart. The directory keeps an index
+    of its content which is loaded here, without scanning the directory.
+    Several processes may safely share one cache directory. Pass an empty
+    path to stop using the cache directory. Returns `false` if the directory
+    cannot be created or locked.
+
+    \fn qicRuntime::setCacheSize()
+    Sets the size limit of the cache directory in bytes. When the limit is
+    exceeded, least recently used libraries are evicted. The default limit is
+    1 GiB.
+
+    \fn qicRuntime::clearBuildCache()
+    Forgets all builds cached in memory. The cache directory is not affected.
+    Cached builds record the headers they include and are rebuilt when one of
+    them is modified, so this is rarely needed.
+
+    \fn qicRuntime::cacheStats()
+    Returns the build cache hit and miss counters.
+
     \fn qicRuntime::ctx()
     Returns pointer to qicContext that can be used to share data with the
     runtime code.
  */
 class QIC_EXPORT qicRuntime : public QObject
 {
+    Q_OBJECT
+
 public:
+    enum BuildMode {
+        QmakeBuild,
+        DirectBuild
+    };
+
+
     qicRuntime(QObject *parent = nullptr);
     ~qicRuntime();
 
     // properties
 
     void setTempDir(QString path);
+    void setInMemoryBuilds(bool enable);
 
     // compile and execute code
 
-    bool exec(QString source);
+    bool exec(QString source, qicScript *script = nullptr);
+    qicScript compileOnly(QString source);
+    bool run(qicScript script);
+    void release(qicScript script);
     bool execFile(QString filename);
     bool watchExecFile(QString filename, bool execNow = true);
+    void setWatchDelay(int msec);
+    bool execProject(QStringList filenames);
+    bool watchExecProject(QStringList filenames, bool execNow = true);
+
+    bool execBatch(QStringList sources);
+    bool execFiles(QStringList filenames);
+
+    bool execCell(QString declarations, QString statements = QString());
+    void clearCells();
+
+    int execAsync(QString source);
+    void cancel(int job = 0);
+    bool isBuilding() const;
 
     // build environment
 
@@ -172,6 +568,8 @@ public:
     bool loadEnv(QString path);
     void setQmake(QString path);
     void setMake(QString path);
+    void setBuildMode(BuildMode mode);
+    void setPrecompiledHeaders(QStringList headers);
     void setDefines(QStringList defines);
     void setIncludePath(QStringList dirs);
     void setIncludeDirs(QList<QDir> dirs);
@@ -179,14 +577,40 @@ public:
     void setQtLibs(QStringList qtlibs);
     void setQtConfig(QStringList qtconf);
     void setAutoDebug(bool enable);
+    void setMaxParallelBuilds(int count);
+    void setBuildTimeout(int msec);
+    void setTieredBuilds(bool enable);
+    void setProfileGuidedBuilds(bool enable, int msec = 60000, int runs = 0);
     void setUnloadLibs(bool unload);
+    bool setBuildServer(QString program);
+    static int runBuildServer(QString name);
+
+    // build cache
+
+    void setBuildCache(bool enable);
+    bool setCacheDir(QString path);
+    void setCacheSize(qint64 bytes);
+    void clearBuildCache();
+    qicCacheStats cacheStats() const;
+
+    // statistics
+
+    qicExecStats lastExecStats() const;
+    bool writeTrace(QString path) const;
 
     // runtime env
 
     qicContext *ctx();
-
-private:
-    bool compile(QString src);
+    void setMaxFrames(int count);
+    void setDropIdleFrames(bool enable);
+    bool popFrame();
+    int frameCount() const;
+    QVector<qicFrameStats> frameStats() const;
+
+signals:
+    void execFinished(int job, bool ok);
+    void execStats(const qicExecStats &stats);
+    void buildOutput(int job, const QString &text);
 
 private:
     qicRuntimePrivate *p;
@@ -1,3 +1,5 @@
+QT += network
+
 HEADERS += \
     $$PWD/qiccontext.h \
     $$PWD/qicentry.h \
@@ -1,6 +1,6 @@
 TEMPLATE = lib
 
-QT += core
+QT += core network
 
 include(qicruntime.pri)
 
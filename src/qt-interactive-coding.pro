@@ -2,4 +2,6 @@ TEMPLATE = subdirs
 CONFIG   = ordered
 
 SUBDIRS += qicruntime
+SUBDIRS += qicbuildd
 SUBDIRS += examples
+SUBDIRS += benchmarks